@@ -0,0 +1,95 @@
+/*
+ * fperf.c - Estimate the time (in seconds) used by a function f, and
+ *     count the hardware events that it causes
+ *
+ * Each event has a counter of its own rather than sharing a group, so
+ * that the events the machine can count are still counted when others
+ * are missing or when there are more events than counters. Counters
+ * multiplexed by the kernel are scaled up to the whole run. Only events
+ * in user mode are counted, which perf_event_paranoid allows up to 2.
+ */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "fperf.h"
+
+/* The perf_event_open type and config of each event */
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[FPERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int fds[FPERF_EVENTS]; /* counter of each event, or -1 */
+
+/*
+ * init_fperf - Open a counter for each event that the machine can count
+ *     in this thread, and return how many it opened
+ */
+int init_fperf(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < FPERF_EVENTS; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/*
+ * fperf - Use the monotonic clock to estimate the running time of
+ * f(argp), and the counters to count its events. Return the average
+ * time of n runs, and store the average counts in counts.
+ */
+double fperf(fperf_test_funct f, void *argp, int n, double *counts)
+{
+    struct timespec start, end;
+    unsigned long long value[3]; /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < FPERF_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++)
+	f(argp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < FPERF_EVENTS; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fds[i], value, sizeof(value)) == sizeof(value) &&
+	    value[2] > 0)
+	    counts[i] = (double)value[0] * value[1] / value[2] / n;
+    }
+    return ((end.tv_sec - start.tv_sec) +
+	    1E-9 * (end.tv_nsec - start.tv_nsec)) / n;
+}
@@ -0,0 +1,23 @@
+/*
+ * fperf.h - Estimate the running time of a function f and count the
+ *     hardware events that it causes, with perf_event_open
+ */
+typedef void (*fperf_test_funct)(void *);
+
+/* The events that fperf counts */
+#define FPERF_CYCLES      0  /* CPU cycles */
+#define FPERF_INSNS       1  /* instructions retired */
+#define FPERF_CACHE_MISS  2  /* last level cache misses */
+#define FPERF_TLB_MISS    3  /* data TLB misses on loads */
+#define FPERF_BRANCH_MISS 4  /* mispredicted branches */
+#define FPERF_FAULTS      5  /* page faults */
+#define FPERF_EVENTS      6
+
+/* Open the counters. Return the number of events that can be counted,
+   which is 0 if perf_event_open is not permitted or not supported */
+int init_fperf(void);
+
+/* Estimate the running time of f(argp) with the monotonic clock and store
+   the number of each event it causes in counts. Both are the average of n
+   runs; an event that the machine cannot count is stored as -1 */
+double fperf(fperf_test_funct f, void *argp, int n, double *counts);
@@ -6,37 +6,72 @@
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
+#include "fperf.h"
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static int timer;   /* one of FSECS_* */
+static double counts[FPERF_EVENTS]; /* events of the last fsecs run */
 
 extern int verbose; /* -v option in mdriver.c */
 
+/* Names of the timers, for the command line */
+static const char *timer_names[FSECS_TIMERS] = {
+    "fcyc", "itimer", "gettod", "perf"
+};
+
+/*
+ * fsecs_timer_name - Return the name of timer t
+ */
+const char *fsecs_timer_name(int t)
+{
+    return (t >= 0 && t < FSECS_TIMERS) ? timer_names[t] : "?";
+}
+
 /*
- * init_fsecs - initialize the timing package
+ * init_fsecs - initialize the timing package to use timer t, or the one
+ *     that config.h picks if it is FSECS_DEFAULT. Return the timer in
+ *     use, or -1 if it cannot be used.
  */
-void init_fsecs(void)
+int init_fsecs(int t)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
-    if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
-
-    /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
-    set_fcyc_epsilon(0.01);
-    set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
-#elif USE_ITIMER
-    if (verbose)
-	printf("Measuring performance with the interval timer.\n");
-#elif USE_GETTOD
-    if (verbose)
-	printf("Measuring performance with gettimeofday().\n");
-#endif
+    if (t == FSECS_DEFAULT)
+	t = USE_FCYC ? FSECS_FCYC : USE_ITIMER ? FSECS_ITIMER : FSECS_GETTOD;
+    timer = t;
+
+    switch (timer) {
+    case FSECS_FCYC:
+	if (verbose)
+	    printf("Measuring performance with a cycle counter.\n");
+
+	/* set key parameters for the fcyc package */
+	set_fcyc_maxsamples(20); 
+	set_fcyc_clear_cache(1);
+	set_fcyc_compensate(1);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = mhz(verbose > 0);
+	break;
+    case FSECS_ITIMER:
+	if (verbose)
+	    printf("Measuring performance with the interval timer.\n");
+	break;
+    case FSECS_GETTOD:
+	if (verbose)
+	    printf("Measuring performance with gettimeofday().\n");
+	break;
+    case FSECS_PERF:
+	if (init_fperf() == 0)
+	    return -1;
+	if (verbose)
+	    printf("Measuring performance with perf_event_open().\n");
+	break;
+    default:
+	return -1;
+    }
+    return timer;
 }
 
 /*
@@ -44,14 +79,30 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
-    double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
-#endif 
+    switch (timer) {
+    case FSECS_FCYC:
+	return fcyc(f, argp)/(Mhz*1e6);
+    case FSECS_ITIMER:
+	return ftimer_itimer(f, argp, 10);
+    case FSECS_PERF:
+	return fperf(f, argp, 10, counts);
+    default:
+	return ftimer_gettod(f, argp, 10);
+    }
 }
 
+/*
+ * fsecs_counts - Store the number of each FPERF_* event in one run of the
+ *     function that fsecs last timed in counts, and return 1, or return
+ *     0 if the timer does not count events
+ */
+int fsecs_counts(double *c)
+{
+    int i;
 
+    if (timer != FSECS_PERF)
+	return 0;
+    for (i = 0; i < FPERF_EVENTS; i++)
+	c[i] = counts[i];
+    return 1;
+}
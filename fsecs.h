@@ -1,4 +1,14 @@
 typedef void (*fsecs_test_funct)(void *);
 
-void init_fsecs(void);
+/* The timers that fsecs can use, picked at run time by init_fsecs */
+#define FSECS_DEFAULT -1 /* the one that config.h picks */
+#define FSECS_FCYC     0 /* K-best cycle counts */
+#define FSECS_ITIMER   1 /* the interval timer */
+#define FSECS_GETTOD   2 /* gettimeofday() */
+#define FSECS_PERF     3 /* the monotonic clock, plus hardware events */
+#define FSECS_TIMERS   4
+
+const char *fsecs_timer_name(int timer);
+int init_fsecs(int timer);
 double fsecs(fsecs_test_funct f, void *argp);
+int fsecs_counts(double *counts);
@@ -0,0 +1,425 @@
+/*
+ * gentrace.c - Generate a synthetic trace
+ *
+ * usage: gentrace [-b] [-n ops] [-l live] [-s sizes] [-t lifetimes]
+ *                 [-r prob] [-g growth] [-m max] [-S seed] [-o file]
+ *
+ * Each block is given a size and a lifetime, in requests, when it is
+ * allocated, and is freed once its lifetime is over. A block that is
+ * still live may be reallocated, growing as the growth pattern says. If
+ * the live set reaches its limit, the block that would die first is
+ * freed early to make room. The trace holds exactly the requested number
+ * of requests and ends with the blocks that are still live.
+ *
+ * Sizes and lifetimes are drawn from distributions written as
+ *
+ *   fixed:<n>                 always n
+ *   uniform:<lo>,<hi>         uniform over lo..hi
+ *   bimodal:<a>,<b>,<p>       b with probability p, otherwise a
+ *   power:<lo>,<hi>,<alpha>   power law over lo..hi with exponent alpha
+ *   exp:<mean>                exponential with the given mean
+ *
+ * and the growth pattern of a realloc is one of
+ *
+ *   grow:<factor>             multiply the size by factor
+ *   add:<bytes>               add bytes to the size
+ *   random                    draw a new size from the size distribution
+ *
+ * The ids of freed blocks are reused, so the trace needs only as many
+ * ids as its largest live set. The same options and seed always give the
+ * same trace, which is generated twice: once to count the ids for the
+ * header, and once to write it out.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tracefmt.h"
+
+/* Kinds of distribution */
+#define DIST_FIXED   0
+#define DIST_UNIFORM 1
+#define DIST_BIMODAL 2
+#define DIST_POWER   3
+#define DIST_EXP     4
+
+/* Kinds of growth pattern */
+#define GROW_FACTOR  0
+#define GROW_ADD     1
+#define GROW_RANDOM  2
+
+/* A distribution of positive numbers */
+typedef struct {
+    int kind;            /* one of DIST_* */
+    double a, b, c;      /* its parameters, in the order written */
+} dist_t;
+
+/* The parameters of a trace */
+typedef struct {
+    unsigned long long num_ops; /* number of requests */
+    unsigned live_max;   /* most blocks live at once */
+    dist_t sizes;        /* sizes of new blocks */
+    dist_t lifetimes;    /* lifetimes of new blocks, in requests */
+    double realloc_prob; /* probability that a request is a realloc */
+    int grow_kind;       /* growth pattern of a realloc, one of GROW_* */
+    double grow;         /* its parameter */
+    int size_max;        /* largest size that a realloc grows to */
+    uint64_t seed;       /* seed of the random numbers */
+} gen_t;
+
+static void generate(const gen_t *g, FILE *out, int binary,
+		     uint32_t *num_ids);
+static void put_request(FILE *out, int binary, int type, uint32_t id,
+			int size);
+static void parse_dist(const char *spec, dist_t *d, const char *what);
+static void parse_growth(const char *spec, gen_t *g);
+static double draw(const dist_t *d, uint64_t *state);
+static int draw_int(const dist_t *d, uint64_t *state, int max);
+static double uniform(uint64_t *state);
+static void usage(void) __attribute__((noreturn));
+
+int main(int argc, char **argv)
+{
+    gen_t g;
+    trace_header_t hdr;
+    unsigned char buf[TRACE_HDRSIZE];
+    FILE *out = stdout;
+    char *path = NULL;
+    uint32_t num_ids;
+    int c, binary = 0;
+
+    g.num_ops = 100000;
+    g.live_max = 1000;
+    parse_dist("power:16,4096,1.2", &g.sizes, "size");
+    parse_dist("exp:1000", &g.lifetimes, "lifetime");
+    g.realloc_prob = 0;
+    parse_growth("grow:2", &g);
+    g.size_max = 1 << 20;
+    g.seed = 1;
+
+    while ((c = getopt(argc, argv, "bn:l:s:t:r:g:m:S:o:h")) != EOF) {
+	switch (c) {
+	case 'b': /* Write a binary trace */
+	    binary = 1;
+	    break;
+	case 'n': /* Number of requests */
+	    g.num_ops = strtoull(optarg, NULL, 10);
+	    if (g.num_ops == 0 || g.num_ops > UINT_MAX)
+		usage();
+	    break;
+	case 'l': /* Most live blocks */
+	    g.live_max = (unsigned)strtoul(optarg, NULL, 10);
+	    if (g.live_max == 0 || g.live_max > TRACE_IDMAX)
+		usage();
+	    break;
+	case 's': /* Size distribution */
+	    parse_dist(optarg, &g.sizes, "size");
+	    break;
+	case 't': /* Lifetime distribution */
+	    parse_dist(optarg, &g.lifetimes, "lifetime");
+	    break;
+	case 'r': /* Probability of a realloc */
+	    g.realloc_prob = atof(optarg);
+	    if (g.realloc_prob < 0 || g.realloc_prob > 1)
+		usage();
+	    break;
+	case 'g': /* Growth pattern of a realloc */
+	    parse_growth(optarg, &g);
+	    break;
+	case 'm': /* Largest size that a realloc grows to */
+	    g.size_max = atoi(optarg);
+	    if (g.size_max < 1)
+		usage();
+	    break;
+	case 'S': /* Seed */
+	    g.seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'o': /* Output file */
+	    path = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc)
+	usage();
+
+    /* The header needs the number of ids, so count them first */
+    generate(&g, NULL, binary, &num_ids);
+
+    if (path != NULL && (out = fopen(path, "w")) == NULL) {
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    if (binary) {
+	hdr.sugg_heapsize = 0;
+	hdr.num_ids = num_ids;
+	hdr.num_ops = g.num_ops;
+	hdr.weight = 1;
+	trace_put_header(buf, &hdr);
+	fwrite(buf, 1, TRACE_HDRSIZE, out);
+    } else
+	fprintf(out, "0\n%u\n%llu\n1\n", num_ids, g.num_ops);
+    generate(&g, out, binary, &num_ids);
+
+    if (ferror(out) || fclose(out) != 0) {
+	fprintf(stderr, "%s: %s\n", path ? path : "stdout", strerror(errno));
+	exit(1);
+    }
+    return 0;
+}
+
+/*
+ * generate - Generate the requests of the trace that g describes,
+ *     writing them to out unless it is NULL, and store the number of ids
+ *     that they use in num_ids. The live blocks are kept in a heap
+ *     ordered by the request at which they die.
+ */
+static void generate(const gen_t *g, FILE *out, int binary,
+		     uint32_t *num_ids)
+{
+    uint32_t *heap;      /* ids of the live blocks, soonest death first */
+    uint32_t *spare;     /* ids of freed blocks, most recent last */
+    int *size;           /* size of each id's block */
+    unsigned long long *death; /* request at which each id's block dies */
+    unsigned long long now, life;
+    unsigned num_live = 0, num_spare = 0, i, j, k;
+    uint32_t id, next_id = 0;
+    uint64_t state = g->seed;
+    double grown;
+
+    heap = malloc(g->live_max * sizeof(*heap));
+    spare = malloc(g->live_max * sizeof(*spare));
+    size = malloc(g->live_max * sizeof(*size));
+    death = malloc(g->live_max * sizeof(*death));
+    if (heap == NULL || spare == NULL || size == NULL || death == NULL) {
+	fprintf(stderr, "gentrace: out of memory\n");
+	exit(1);
+    }
+
+    for (now = 0; now < g->num_ops; now++) {
+	if (num_live > 0 && death[heap[0]] > now &&
+	    uniform(&state) <= g->realloc_prob) {
+	    /* Reallocate a live block */
+	    id = heap[(unsigned)(uniform(&state) * num_live) % num_live];
+	    switch (g->grow_kind) {
+	    case GROW_FACTOR:
+		grown = size[id] * g->grow;
+		break;
+	    case GROW_ADD:
+		grown = size[id] + g->grow;
+		break;
+	    default:
+		grown = draw_int(&g->sizes, &state, INT_MAX);
+		break;
+	    }
+	    size[id] = (grown < 1) ? 1 :
+		(grown > g->size_max) ? g->size_max : (int)grown;
+	    put_request(out, binary, TRACE_REALLOC, id, size[id]);
+	    continue;
+	}
+
+	if (num_live > 0 && (death[heap[0]] <= now ||
+			     num_live == g->live_max)) {
+	    /* Free the block that dies first */
+	    id = heap[0];
+	    put_request(out, binary, TRACE_FREE, id, 0);
+	    spare[num_spare++] = id;
+	    id = heap[--num_live];
+	    for (i = 0; (j = 2 * i + 1) < num_live; i = k) {
+		k = (j + 1 < num_live && death[heap[j + 1]] < death[heap[j]]) ?
+		    j + 1 : j;
+		if (death[heap[k]] >= death[id])
+		    break;
+		heap[i] = heap[k];
+	    }
+	    heap[i] = id;
+	    continue;
+	}
+
+	/* Allocate a block */
+	id = (num_spare > 0) ? spare[--num_spare] : next_id++;
+	size[id] = draw_int(&g->sizes, &state, INT_MAX);
+	life = (unsigned long long)draw_int(&g->lifetimes, &state, INT_MAX);
+	death[id] = now + life;
+	for (i = num_live++; i > 0 && death[heap[(i - 1) / 2]] > death[id];
+	     i = (i - 1) / 2)
+	    heap[i] = heap[(i - 1) / 2];
+	heap[i] = id;
+	put_request(out, binary, TRACE_ALLOC, id, size[id]);
+    }
+
+    *num_ids = next_id;
+    free(heap);
+    free(spare);
+    free(size);
+    free(death);
+}
+
+/*
+ * put_request - Write a request to out as a text or binary op, unless
+ *     out is NULL
+ */
+static void put_request(FILE *out, int binary, int type, uint32_t id,
+			int size)
+{
+    unsigned char buf[TRACE_OPMAX];
+
+    if (out == NULL)
+	return;
+    if (binary)
+	fwrite(buf, 1, trace_put_op(buf, type, id, (uint32_t)size), out);
+    else if (type == TRACE_FREE)
+	fprintf(out, "f %u\n", id);
+    else
+	fprintf(out, "%c %u %d\n", type == TRACE_ALLOC ? 'a' : 'r', id, size);
+}
+
+/*
+ * parse_dist - Parse the distribution spec into d, or exit with a
+ *     message that names it as the distribution of what
+ */
+static void parse_dist(const char *spec, dist_t *d, const char *what)
+{
+    static const struct {
+	const char *name;
+	int kind;
+	int nparams;
+    } kinds[] = {
+	{ "fixed", DIST_FIXED, 1 },
+	{ "uniform", DIST_UNIFORM, 2 },
+	{ "bimodal", DIST_BIMODAL, 3 },
+	{ "power", DIST_POWER, 3 },
+	{ "exp", DIST_EXP, 1 },
+    };
+    const char *params = strchr(spec, ':');
+    size_t len = params ? (size_t)(params - spec) : strlen(spec);
+    unsigned i;
+    int n;
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+	if (strlen(kinds[i].name) == len &&
+	    strncmp(spec, kinds[i].name, len) == 0)
+	    break;
+    }
+    if (i == sizeof(kinds) / sizeof(kinds[0]) || params == NULL)
+	goto bad;
+    d->kind = kinds[i].kind;
+    d->b = d->c = 0;
+    n = sscanf(params + 1, "%lf,%lf,%lf", &d->a, &d->b, &d->c);
+    if (n != kinds[i].nparams || d->a <= 0)
+	goto bad;
+    if ((d->kind == DIST_UNIFORM || d->kind == DIST_POWER) && d->b < d->a)
+	goto bad;
+    if (d->kind == DIST_BIMODAL && (d->b <= 0 || d->c < 0 || d->c > 1))
+	goto bad;
+    if (d->kind == DIST_POWER && d->c <= 0)
+	goto bad;
+    return;
+
+bad:
+    fprintf(stderr, "gentrace: bad %s distribution \"%s\"\n", what, spec);
+    exit(1);
+}
+
+/*
+ * parse_growth - Parse the growth pattern spec into g, or exit
+ */
+static void parse_growth(const char *spec, gen_t *g)
+{
+    if (strcmp(spec, "random") == 0) {
+	g->grow_kind = GROW_RANDOM;
+	g->grow = 0;
+    } else if (sscanf(spec, "grow:%lf", &g->grow) == 1 && g->grow > 0)
+	g->grow_kind = GROW_FACTOR;
+    else if (sscanf(spec, "add:%lf", &g->grow) == 1)
+	g->grow_kind = GROW_ADD;
+    else {
+	fprintf(stderr, "gentrace: bad growth pattern \"%s\"\n", spec);
+	exit(1);
+    }
+}
+
+/*
+ * draw - Return a number drawn from the distribution d
+ */
+static double draw(const dist_t *d, uint64_t *state)
+{
+    double u = uniform(state);
+
+    switch (d->kind) {
+    case DIST_FIXED:
+	return d->a;
+    case DIST_UNIFORM:
+	return d->a + u * (d->b - d->a + 1);
+    case DIST_BIMODAL:
+	return (u <= d->c) ? d->b : d->a;
+    case DIST_POWER:
+	/* Invert the distribution function of the bounded Pareto */
+	return d->a * pow(1 - u * (1 - pow(d->a / d->b, d->c)), -1 / d->c);
+    default:
+	return -d->a * log(u);
+    }
+}
+
+/*
+ * draw_int - Return a whole number from 1 to max drawn from d
+ */
+static int draw_int(const dist_t *d, uint64_t *state, int max)
+{
+    double x = draw(d, state);
+
+    return (x < 1) ? 1 : (x >= max) ? max : (int)x;
+}
+
+/*
+ * uniform - Return a random number in (0, 1], from the xorshift64*
+ *     generator whose state is at state, so that traces do not depend on
+ *     the C library's generator
+ */
+static double uniform(uint64_t *state)
+{
+    uint64_t x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double)(((x * 0x2545f4914f6cdd1dULL) >> 11) + 1) /
+	9007199254740992.0;
+}
+
+/*
+ * usage - Explain the command line arguments and exit
+ */
+static void usage(void)
+{
+    fprintf(stderr,
+	    "Usage: gentrace [-b] [-n <ops>] [-l <live>] [-s <sizes>] "
+	    "[-t <lifetimes>]\n"
+	    "                [-r <prob>] [-g <growth>] [-m <max>] "
+	    "[-S <seed>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace.\n");
+    fprintf(stderr, "\t-n <ops>   Number of requests (100000).\n");
+    fprintf(stderr, "\t-l <live>  Most blocks live at once (1000).\n");
+    fprintf(stderr, "\t-s <dist>  Sizes of blocks (power:16,4096,1.2).\n");
+    fprintf(stderr, "\t-t <dist>  Lifetimes of blocks in requests "
+	    "(exp:1000).\n");
+    fprintf(stderr, "\t-r <prob>  Probability of a realloc (0).\n");
+    fprintf(stderr, "\t-g <grow>  Growth of a realloc: grow:<factor>, "
+	    "add:<bytes> or random\n\t           (grow:2).\n");
+    fprintf(stderr, "\t-m <max>   Largest size a realloc grows to "
+	    "(1048576).\n");
+    fprintf(stderr, "\t-S <seed>  Seed of the random numbers (1).\n");
+    fprintf(stderr, "\t-o <file>  Write the trace to <file>, not stdout.\n");
+    fprintf(stderr, "Distributions: fixed:<n>, uniform:<lo>,<hi>, "
+	    "bimodal:<a>,<b>,<p>,\n"
+	    "               power:<lo>,<hi>,<alpha> or exp:<mean>\n");
+    exit(1);
+}
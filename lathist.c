@@ -0,0 +1,126 @@
+/*
+ * lathist.c - Record and read the latency histograms of lathist.h
+ */
+#include <string.h>
+
+#include "lathist.h"
+
+#define LAT_CALIBRATE_NS 20000000 /* time spent pricing a tick (ns) */
+
+/* Find the bucket of a value, and the smallest value of a bucket */
+static int lat_bucket(uint64_t v);
+static uint64_t lat_bucket_lo(int b);
+
+/*
+ * lat_tick_ns - Return the number of nanoseconds in a tick of lat_now.
+ *     The cycle counter is priced against the monotonic clock the first
+ *     time, which takes LAT_CALIBRATE_NS.
+ */
+double lat_tick_ns(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static double tick_ns;
+    struct timespec t0, t1;
+    uint64_t c0, c1;
+    long long ns;
+
+    if (tick_ns > 0)
+	return tick_ns;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = lat_now();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (long long)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+	    (t1.tv_nsec - t0.tv_nsec);
+    } while (ns < LAT_CALIBRATE_NS);
+    c1 = lat_now();
+    tick_ns = (double)ns / (double)(c1 - c0);
+    return tick_ns;
+#else
+    return 1.0;
+#endif
+}
+
+/*
+ * lat_clear - Empty the histogram h
+ */
+void lat_clear(lathist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * lat_record - Count the value v in the histogram h
+ */
+void lat_record(lathist_t *h, uint64_t v)
+{
+    h->bucket[lat_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * lat_merge - Add the counts of the histogram src to those of dst
+ */
+void lat_merge(lathist_t *dst, const lathist_t *src)
+{
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+	dst->bucket[b] += src->bucket[b];
+    dst->count += src->count;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/*
+ * lat_percentile - Return the value below which the fraction q of the
+ *     values in h lie, as the top of the bucket that holds it, or 0 if
+ *     h is empty
+ */
+uint64_t lat_percentile(const lathist_t *h, double q)
+{
+    uint64_t rank, seen = 0, hi;
+    int b;
+
+    if (h->count == 0)
+	return 0;
+    rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count)
+	rank = h->count - 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->bucket[b];
+	if (seen > rank)
+	    break;
+    }
+    hi = (b + 1 < LAT_BUCKETS) ? lat_bucket_lo(b + 1) - 1 : UINT64_MAX;
+    return (hi < h->max) ? hi : h->max;
+}
+
+/*
+ * lat_bucket - Return the bucket that counts v: one per value below
+ *     LAT_SUB, then LAT_SUB per power of two
+ */
+static int lat_bucket(uint64_t v)
+{
+    int shift;
+
+    if (v < LAT_SUB)
+	return (int)v;
+    shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) | (int)((v >> shift) & (LAT_SUB - 1));
+}
+
+/*
+ * lat_bucket_lo - Return the smallest value that bucket b counts
+ */
+static uint64_t lat_bucket_lo(int b)
+{
+    int shift;
+
+    if (b < LAT_SUB)
+	return (uint64_t)b;
+    shift = (b >> LAT_SUB_BITS) - 1;
+    return (uint64_t)(LAT_SUB + (b & (LAT_SUB - 1))) << shift;
+}
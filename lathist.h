@@ -0,0 +1,48 @@
+/*
+ * lathist.h - Log-linear latency histograms
+ *
+ * A histogram counts values, such as the ticks that one request took, in
+ * buckets whose width doubles every LAT_SUB buckets. Each bucket is thus
+ * at most 1/LAT_SUB of its values wide, recording a value costs a few
+ * instructions, and percentiles read back to within that precision.
+ *
+ * lat_now reads the cycle counter where there is one and a monotonic
+ * clock elsewhere; lat_tick_ns converts its ticks to nanoseconds.
+ */
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LAT_SUB_BITS 4                   /* log2 of buckets per octave */
+#define LAT_SUB      (1 << LAT_SUB_BITS) /* buckets per power of two */
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/* A histogram of values */
+typedef struct {
+    uint64_t count;               /* number of values recorded */
+    uint64_t max;                 /* largest value recorded */
+    uint64_t bucket[LAT_BUCKETS]; /* count of each bucket */
+} lathist_t;
+
+/*
+ * lat_now - Return the current time in ticks
+ */
+static inline uint64_t lat_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+double lat_tick_ns(void);
+void lat_clear(lathist_t *h);
+void lat_record(lathist_t *h, uint64_t v);
+void lat_merge(lathist_t *dst, const lathist_t *src);
+uint64_t lat_percentile(const lathist_t *h, double q);
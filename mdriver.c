@@ -7,6 +7,10 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,10 +20,17 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fperf.h"
+#include "lathist.h"
+#include "tracefmt.h"
 #include "config.h"
 
 /**********************
@@ -30,19 +41,31 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define TRACE_CHUNK 4096 /* requests decoded at a time from a binary trace */
+#define REPLAY_SPINS 1000 /* spins of a waiting replay thread between yields */
+#define LAT_CLASSES    6 /* request size classes of the latency histograms */
+#define LAT_SLOWEST   10 /* slowest requests listed by the latency replay */
+#define API_BATCH     32 /* blocks allocated at once by the API check */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
+/* Heap priority of a range in the range tree */
+#define RANGE_PRIO(p)  ((uintptr_t)(p)->lo * (uintptr_t)0x9e3779b97f4a7c15ULL)
+
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload, as a node of a treap that
+ * is ordered by lo and heap-ordered by a hash of lo
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* subtree of lower payloads */
+    struct range_t *right; /* subtree of higher payloads */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -50,15 +73,28 @@ typedef struct {
     enum {ALLOC, FREE, REALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int thread;                       /* thread that made the request */
 } traceop_t;
 
-/* Holds the information for one trace file*/
+/* 
+ * Holds the information for one trace file. A text trace is parsed into
+ * ops up front. A binary trace is mapped, and replayed by decoding
+ * TRACE_CHUNK requests at a time into ops, so that it never has to fit
+ * in memory.
+ */
 typedef struct {
     unsigned sugg_heapsize;   /* suggested heap size (unused) */
     unsigned num_ids;         /* number of alloc/realloc ids */
     unsigned num_ops;         /* number of distinct requests */
     unsigned weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or a chunk of them */
+    unsigned num_buf;    /* number of requests in ops */
+    unsigned next;       /* index in ops of the next request */
+    unsigned char *map;  /* mapping of a binary trace, or NULL */
+    size_t map_size;     /* bytes in the mapping */
+    const unsigned char *cur; /* next undecoded request in the mapping */
+    unsigned left;       /* number of requests not yet decoded */
+    unsigned thread;     /* thread of the next request to be decoded */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
@@ -73,6 +109,41 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/*
+ * Holds the state that the threads of a threaded replay share. Each
+ * request waits until the requests before it on the same block id are
+ * done, whichever threads they belong to, so that a block is freed only
+ * once it is allocated, by another thread if the trace says so.
+ */
+typedef struct {
+    traceop_t *ops;      /* every request of the trace, in order */
+    unsigned *seq;       /* number of each request among those on its id */
+    char **blocks;       /* block of each id */
+    unsigned *done;      /* number of requests done on each id */
+    int start;           /* set to start the threads at once */
+} replay_t;
+
+/*
+ * Holds one thread of a threaded replay: its stream of requests, which
+ * refer to ids base and up, and the latencies that it measured
+ */
+typedef struct {
+    pthread_t tid;
+    replay_t *replay;    /* the state shared by all the threads */
+    unsigned *reqs;      /* indexes in replay->ops of its requests */
+    unsigned num_reqs;   /* number of requests in reqs */
+    unsigned base;       /* added to the id of each of its requests */
+    lathist_t hist;      /* latency of its requests, in ticks */
+} replay_thread_t;
+
+/* Records one of the slowest requests of a latency replay */
+typedef struct {
+    uint64_t ticks;      /* time the request took */
+    unsigned opnum;      /* its number in the trace */
+    int type;            /* its type */
+    int size;            /* its size, or the freed block's */
+} slow_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -83,19 +154,50 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only for the perf timer (-M perf) */
+    int counted;     /* were the events of the timed runs counted? */
+    double counts[FPERF_EVENTS]; /* number of each event in one run, or -1 */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* Holds what a worker of a parallel evaluation (-j) found in its trace */
+typedef struct {
+    stats_t stats;       /* the trace's stats */
+    int errors;          /* errors found in the trace */
+    unsigned long node_local;  /* blocks on the worker's NUMA node */
+    unsigned long node_remote; /* blocks on some other NUMA node */
+} job_result_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static unsigned long node_local;  /* blocks on the caller's NUMA node */
+static unsigned long node_remote; /* blocks on some other NUMA node */
+static int check_level = -1;      /* mm_checkheap level after each op (-c) */
+static int thread_max = 0;        /* most threads of the threaded replay (-T) */
+static int latency = 0;           /* print per-request latencies (-L) */
+static int jobs = -1;             /* traces evaluated at once (-j), or -1 */
+static int *job_cpus;             /* CPUs to pin the workers to (-P) */
+static int num_job_cpus;          /* number of CPUs in job_cpus */
+static unsigned long api_mallocs; /* blocks the API check allocated */
+static unsigned long api_frees;   /* blocks the API check freed */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Request names, and the largest size of each latency size class */
+static char *op_names[] = { "malloc", "free", "realloc" };
+static int lat_class_max[LAT_CLASSES - 1] = { 64, 512, 4096, 32768, 262144 };
+static size_t api_sizes[] = { 1, 24, 100, 1000, 5000, 70000, 200000 };
+static size_t api_aligns[] = { 32, 64, 256, 4096, 65536 };
+static char *lat_class_names[LAT_CLASSES] = {
+    "<=64", "<=512", "<=4K", "<=32K", "<=256K", ">256K"
+};
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -106,15 +208,21 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *find_range(range_t *ranges, char *hi);
+static void insert_range(range_t **ranges, range_t *p);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void map_trace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
+static void rewind_trace(trace_t *trace);
+static traceop_t *next_request(trace_t *trace);
+static int decode_requests(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -122,16 +230,32 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
+static void eval_mm_trace(char *tracedir, char *tracefile, int tracenum,
+			  stats_t *stats, range_t **ranges);
+static void eval_mm_jobs(char *tracedir, char **tracefiles, int n,
+			 stats_t *stats, range_t **ranges);
+static int parse_cpus(char *list, int **cpus);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_threads(trace_t *trace, int tracenum);
+static void *replay_thread(void *arg);
+static void eval_mm_latency(trace_t *trace, int tracenum);
+static int lat_class(int size);
+static void eval_mm_api(void);
+static void api_fill(char *p, size_t size, int old, int new, char *what);
+static void api_stats(char *what);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void print_counts(int n, stats_t *stats);
+static void count_node(char *p);
+static void print_mm_stats(void);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
+static void api_error(char *what, char *msg);
 
 /**************
  * Main routine
@@ -144,13 +268,17 @@ int main(int argc, char **argv)
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    char *cpu_list = NULL;     /* CPUs to pin the workers to (set by -P) */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    int api_check = 0;   /* If set, check the rest of the mm API (set by -A) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int backing = MEM_BACKING_PAGES; /* How to back the heap (set by -H) */
+    int timer = FSECS_DEFAULT; /* How to time the traces (set by -M) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,8 +287,11 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "c:f:t:H:j:M:P:T:ALhvVgal")) != EOF) {
         switch (c) {
+	case 'c': /* Check the heap after every request */
+	    check_level = atoi(optarg);
+	    break;
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
@@ -179,6 +310,45 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'H': /* How to back the heap: pages, thp or hugetlb */
+	    for (backing = MEM_BACKING_HUGETLB; backing >= 0; backing--)
+		if (!strcmp(optarg, mem_backing_name(backing)))
+		    break;
+	    if (backing < 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'j': /* Evaluate this many traces at once, 0 for one per CPU */
+	    if ((jobs = atoi(optarg)) < 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'P': /* Pin the workers to these CPUs, or the isolated ones */
+	    cpu_list = optarg;
+	    break;
+	case 'M': /* How to time the traces: fcyc, itimer, gettod or perf */
+	    for (timer = FSECS_TIMERS - 1; timer >= 0; timer--)
+		if (!strcmp(optarg, fsecs_timer_name(timer)))
+		    break;
+	    if (timer < 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'T': /* Replay each trace on up to this many threads */
+	    if ((thread_max = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'L': /* Time each request and print the latencies */
+	    latency = 1;
+	    break;
+	case 'A': /* Check the routines of the mm API that traces don't use */
+	    api_check = 1;
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
@@ -236,8 +406,20 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* Size the job pool: by -j, else by -P, else one job per CPU */
+    if (cpu_list != NULL &&
+	(num_job_cpus = parse_cpus(cpu_list, &job_cpus)) == 0)
+	app_error("ERROR: -P names no CPUs");
+    if (jobs == 0 || (jobs < 0 && num_job_cpus > 0))
+	jobs = num_job_cpus > 0 ? num_job_cpus :
+	    (int)sysconf(_SC_NPROCESSORS_ONLN);
+
     /* Initialize the timing package */
-    init_fsecs();
+    if (init_fsecs(timer) < 0) {
+	printf("ERROR: Cannot measure performance with the %s timer\n",
+	       fsecs_timer_name(timer));
+	exit(1);
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -263,6 +445,7 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].counted = fsecs_counts(libc_stats[i].counts);
 	    }
 	    free_trace(trace);
 	}
@@ -286,32 +469,24 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
+    backing = mem_init_backing(backing);
+    printf("Heap backing: %s\n", mem_backing_name(backing));
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    if (jobs > 0)
+	eval_mm_jobs(tracedir, tracefiles, num_tracefiles, mm_stats, &ranges);
+    else
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracedir, tracefiles[i], i, &mm_stats[i], &ranges);
+    if (api_check)
+	eval_mm_api();
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
+	printf("NUMA: %d node(s), %lu local and %lu remote blocks\n",
+	       mem_numa_nodes(), node_local, node_remote);
 	printf("\n");
     }
 
@@ -368,16 +543,17 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Each
+ * operation takes O(log n) expected time for n live payloads.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
@@ -396,59 +572,66 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of one of the heaps */
+    if (!mem_is_heap(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. The payloads in
+     * the tree are disjoint, so if any of them overlaps this one, the
+     * last one to start at or below hi does.
+     */
+    if ((p = find_range(*ranges, hi)) != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    insert_range(ranges, p);
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
- *
- * XXX alc: It's unclear what the variable "size" was used for.
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    range_t *p, *l, *r;
+
+    while ((p = *ranges) != NULL && p->lo != lo)
+	ranges = (lo < p->lo) ? &p->left : &p->right;
+    if (p == NULL)
+	return;
+
+    /* Merge the subtrees of p in its place */
+    l = p->left;
+    r = p->right;
+    while (l != NULL && r != NULL) {
+	if (RANGE_PRIO(l) > RANGE_PRIO(r)) {
+	    *ranges = l;
+	    ranges = &l->right;
+	    l = l->right;
+	} else {
+	    *ranges = r;
+	    ranges = &r->left;
+	    r = r->left;
+	}
     }
+    *ranges = (l != NULL) ? l : r;
+    free(p);
 }
 
 /*
@@ -457,13 +640,62 @@ static void remove_range(range_t **ranges, char *lo)
 static void clear_ranges(range_t **ranges)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    /* Free the right spine, recursing into the left subtrees */
+    while ((p = *ranges) != NULL) {
+	clear_ranges(&p->left);
+	*ranges = p->right;
+	free(p);
     }
-    *ranges = NULL;
+}
+
+/*
+ * find_range - Return the range that starts last at or below hi,
+ *     or NULL if every range starts above hi
+ */
+static range_t *find_range(range_t *ranges, char *hi)
+{
+    range_t *best = NULL;
+
+    while (ranges != NULL) {
+	if (ranges->lo <= hi) {
+	    best = ranges;
+	    ranges = ranges->right;
+	} else
+	    ranges = ranges->left;
+    }
+    return best;
+}
+
+/*
+ * insert_range - Insert the range p, which overlaps no range in the
+ *     tree, into the range tree
+ */
+static void insert_range(range_t **ranges, range_t *p)
+{
+    range_t **lp, **rp;
+    range_t *t;
+
+    /* Descend past the ranges that outrank p */
+    while ((t = *ranges) != NULL && RANGE_PRIO(t) > RANGE_PRIO(p))
+	ranges = (p->lo < t->lo) ? &t->left : &t->right;
+
+    /* Split the rest of the subtree around p to form its children */
+    lp = &p->left;
+    rp = &p->right;
+    while (t != NULL) {
+	if (t->lo < p->lo) {
+	    *lp = t;
+	    lp = &t->right;
+	    t = t->right;
+	} else {
+	    *rp = t;
+	    rp = &t->left;
+	    t = t->left;
+	}
+    }
+    *lp = *rp = NULL;
+    *ranges = p;
 }
 
 
@@ -472,7 +704,8 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory, or map it if
+ *     it is a binary trace
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -480,9 +713,11 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
+    char magic[sizeof(TRACE_MAGIC) - 1];
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    unsigned thread = 0;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -498,6 +733,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+    if (fread(magic, 1, sizeof(magic), tracefile) == sizeof(magic) &&
+	memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+	fclose(tracefile);
+	map_trace(trace, path);
+	return trace;
+    }
+    rewind(tracefile);
+    trace->map = NULL;
     fscanf(tracefile, "%u", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%u", &(trace->num_ids));     
     fscanf(tracefile, "%u", &(trace->num_ops));     
@@ -542,44 +785,349 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 't': /* the requests that follow are the thread's */
+	    fscanf(tracefile, "%u", &thread);
+	    continue;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
 	    exit(1);
 	}
+	trace->ops[op_index].thread = thread;
 	op_index++;
 	
     }
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+    trace->num_buf = op_index;
+    trace->next = 0;
     
     return trace;
 }
 
+/*
+ * map_trace - map the binary trace file at path into trace
+ */
+static void map_trace(trace_t *trace, char *path)
+{
+    trace_header_t hdr;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Could not open %s in map_trace", path);
+	unix_error(msg);
+    }
+    if ((size_t)st.st_size < TRACE_HDRSIZE) {
+	sprintf(msg, "Truncated header in binary trace %s", path);
+	app_error(msg);
+    }
+    trace->map_size = (size_t)st.st_size;
+    if ((trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE,
+			   fd, 0)) == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    close(fd);
+
+    /* The requests are read once per pass, front to back */
+    madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
+
+    trace_get_header(trace->map, &hdr);
+    if (hdr.num_ops > UINT_MAX || hdr.num_ids > TRACE_IDMAX + 1) {
+	sprintf(msg, "Binary trace %s is too large", path);
+	app_error(msg);
+    }
+    trace->sugg_heapsize = hdr.sugg_heapsize;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = (unsigned)hdr.num_ops;
+    trace->weight = hdr.weight;
+
+    if ((trace->ops = 
+	 (traceop_t *)malloc(TRACE_CHUNK * sizeof(traceop_t))) == NULL)
+	unix_error("malloc 2 failed in map_trace");
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_trace");
+    rewind_trace(trace);
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), and
+ *              unmap a binary trace.
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_size);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * rewind_trace - Start the next pass over the requests of trace
+ */
+static void rewind_trace(trace_t *trace)
+{
+    trace->next = 0;
+    if (trace->map != NULL) {
+	trace->num_buf = 0;
+	trace->cur = trace->map + TRACE_HDRSIZE;
+	trace->left = trace->num_ops;
+	trace->thread = 0;
+    }
+}
+
+/*
+ * next_request - Return the next request of trace, or NULL once the
+ *     pass is over
+ */
+static traceop_t *next_request(trace_t *trace)
+{
+    if (trace->next == trace->num_buf && !decode_requests(trace))
+	return NULL;
+    return &trace->ops[trace->next++];
+}
+
+/*
+ * decode_requests - Decode the next chunk of a binary trace's requests
+ *     into trace->ops. Returns 0 if there are none left.
+ */
+static int decode_requests(trace_t *trace)
+{
+    const unsigned char *end = trace->map + trace->map_size;
+    traceop_t *op;
+    uint32_t id, size;
+    int type;
+
+    if (trace->map == NULL || trace->left == 0)
+	return 0;
+    trace->num_buf = (trace->left < TRACE_CHUNK) ? trace->left : TRACE_CHUNK;
+    for (op = trace->ops; op < trace->ops + trace->num_buf; ) {
+	trace->cur = trace_get_op(trace->cur, end, &type, &id, &size);
+	if (trace->cur == NULL || size > INT_MAX ||
+	    (type != TRACE_THREAD && id >= trace->num_ids))
+	    app_error("Malformed request in binary trace");
+	if (type == TRACE_THREAD) {
+	    trace->thread = id;
+	    continue;
+	}
+	op->type = (type == TRACE_ALLOC) ? ALLOC :
+	    (type == TRACE_REALLOC) ? REALLOC : FREE;
+	op->index = (int)id;
+	op->size = (int)size;
+	op->thread = (int)trace->thread;
+	op++;
+    }
+    trace->left -= trace->num_buf;
+    trace->next = 0;
+    return 1;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * eval_mm_trace - Evaluate the mm malloc package on one trace: check its
+ *     correctness, then measure its utilization and speed, and store
+ *     them in stats
+ */
+static void eval_mm_trace(char *tracedir, char *tracefile, int tracenum,
+			  stats_t *stats, range_t **ranges)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, ranges);
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+	stats->counted = fsecs_counts(stats->counts);
+	if (verbose > 1)
+	    print_mm_stats();
+	if (latency)
+	    eval_mm_latency(trace, tracenum);
+	if (thread_max > 0)
+	    eval_mm_threads(trace, tracenum);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_jobs - Evaluate the mm malloc package on n traces, up to jobs
+ *     of them at once, each in a worker process of its own.
+ *
+ *     A forked worker has a copy of the simulated heap, so the workers
+ *     do not share one. Each worker writes its results to shared memory
+ *     and its output to a temporary file, and the output is printed in
+ *     trace order. Worker slot k is pinned to job_cpus[k], if -P gave
+ *     any CPUs, so that the timed runs do not move between cores.
+ */
+static void eval_mm_jobs(char *tracedir, char **tracefiles, int n,
+			 stats_t *stats, range_t **ranges)
+{
+    job_result_t *results; /* what each trace's worker found */
+    FILE **outs;           /* output of each trace's worker */
+    char *done;            /* has each trace's worker exited? */
+    pid_t *slot_pid;       /* worker in each slot, or 0 */
+    int *slot_trace;       /* trace of the worker in each slot */
+    int next = 0, printed = 0, running = 0, k, status;
+    cpu_set_t cpus;
+    char buf[MAXLINE];
+    size_t len;
+    pid_t pid;
+
+    results = mmap(NULL, n * sizeof(job_result_t), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+	unix_error("mmap in eval_mm_jobs failed");
+    outs = calloc(n, sizeof(FILE *));
+    done = calloc(n, 1);
+    slot_pid = calloc(jobs, sizeof(pid_t));
+    slot_trace = calloc(jobs, sizeof(int));
+    if (outs == NULL || done == NULL || slot_pid == NULL || slot_trace == NULL)
+	unix_error("calloc in eval_mm_jobs failed");
+
+    while (printed < n) {
+	/* Start a worker in each free slot */
+	for (k = 0; k < jobs && next < n; k++) {
+	    if (slot_pid[k] != 0)
+		continue;
+	    if ((outs[next] = tmpfile()) == NULL)
+		unix_error("tmpfile in eval_mm_jobs failed");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork in eval_mm_jobs failed");
+	    if (pid == 0) {
+		if (num_job_cpus > 0) {
+		    CPU_ZERO(&cpus);
+		    CPU_SET(job_cpus[k % num_job_cpus], &cpus);
+		    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			unix_error("sched_setaffinity in eval_mm_jobs failed");
+		}
+		dup2(fileno(outs[next]), STDOUT_FILENO);
+		errors = 0;
+		node_local = node_remote = 0;
+		eval_mm_trace(tracedir, tracefiles[next], next,
+			      &results[next].stats, ranges);
+		results[next].errors = errors;
+		results[next].node_local = node_local;
+		results[next].node_remote = node_remote;
+		fflush(stdout);
+		_exit(0);
+	    }
+	    slot_pid[k] = pid;
+	    slot_trace[k] = next++;
+	    running++;
+	}
+
+	/* Wait for a worker to exit */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait in eval_mm_jobs failed");
+	for (k = 0; k < jobs && slot_pid[k] != pid; k++)
+	    ;
+	if (k == jobs)
+	    continue;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    memset(&results[slot_trace[k]], 0, sizeof(job_result_t));
+	    results[slot_trace[k]].errors = 1;
+	    fprintf(outs[slot_trace[k]],
+		    "ERROR [trace %d]: worker %s with status %d\n",
+		    slot_trace[k], WIFEXITED(status) ? "exited" : "was killed",
+		    WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+	}
+	done[slot_trace[k]] = 1;
+	slot_pid[k] = 0;
+	running--;
+
+	/* Print the traces that are done, in order */
+	for (; printed < n && done[printed]; printed++) {
+	    rewind(outs[printed]);
+	    while ((len = fread(buf, 1, sizeof(buf), outs[printed])) > 0)
+		fwrite(buf, 1, len, stdout);
+	    fclose(outs[printed]);
+	    stats[printed] = results[printed].stats;
+	    errors += results[printed].errors;
+	    node_local += results[printed].node_local;
+	    node_remote += results[printed].node_remote;
+	}
+    }
+
+    munmap(results, n * sizeof(job_result_t));
+    free(outs);
+    free(done);
+    free(slot_pid);
+    free(slot_trace);
+}
+
+/*
+ * parse_cpus - Parse a list of CPUs such as "2-5,7" into a new array in
+ *     *cpus, and return its length. The list "isolated" names the CPUs
+ *     that the kernel keeps other tasks off (isolcpus=).
+ */
+static int parse_cpus(char *list, int **cpus)
+{
+    char line[MAXLINE], *p, *end;
+    long lo, hi;
+    int n = 0;
+    FILE *fp;
+
+    if (!strcmp(list, "isolated")) {
+	line[0] = '\0';
+	if ((fp = fopen("/sys/devices/system/cpu/isolated", "r")) != NULL) {
+	    if (fgets(line, MAXLINE, fp) == NULL)
+		line[0] = '\0';
+	    fclose(fp);
+	}
+	list = line;
+    }
+
+    *cpus = NULL;
+    for (p = list; *p != '\0' && *p != '\n'; p = end + (*end == ',')) {
+	lo = hi = strtol(p, &end, 10);
+	if (end == p)
+	    app_error("ERROR: bad CPU list for -P");
+	if (*end == '-') {
+	    p = end + 1;
+	    hi = strtol(p, &end, 10);
+	    if (end == p || hi < lo)
+		app_error("ERROR: bad CPU list for -P");
+	}
+	if (lo < 0 || hi >= CPU_SETSIZE)
+	    app_error("ERROR: bad CPU list for -P");
+	for (; lo <= hi; lo++) {
+	    if ((*cpus = realloc(*cpus, (n + 1) * sizeof(int))) == NULL)
+		unix_error("realloc in parse_cpus failed");
+	    (*cpus)[n++] = (int)lo;
+	}
+    }
+    return n;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
     unsigned i, j;
+    traceop_t *op;
     int index;
     unsigned size;
     unsigned oldsize;
@@ -587,7 +1135,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -598,11 +1146,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    rewind_trace(trace);
+    for (i = 0;  (op = next_request(trace)) != NULL;  i++) {
+	index = op->index;
+	size = op->size;
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -614,7 +1163,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -626,6 +1175,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     * data was copied to the new block
 	     */
 	    memset(p, index & 0xFF, size);
+	    count_node(p);
 
 	    /* Remember region */
 	    trace->blocks[index] = p;
@@ -641,10 +1191,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -656,13 +1206,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
 	      }
 	    }
 	    memset(newp, index & 0xFF, size);
+	    count_node(newp);
 
 	    /* Remember region */
 	    trace->blocks[index] = newp;
@@ -681,6 +1232,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Optionally check the heap after every request (-c) */
+	if (check_level >= 0 && mm_checkheap(check_level) > 0) {
+	    malloc_error(tracenum, i, "mm_checkheap found errors.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -692,15 +1248,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak size of the heap in bytes while running the student's malloc 
+ *   package on the trace. A negative mem_sbrk() gives memory back, so 
+ *   the heap may end smaller than it once was; mem_heap_peak() keeps
+ *   its largest size instead.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    unsigned i;
+    traceop_t *op;
     int index;
     unsigned size, newsize, oldsize;
     int max_total_size = 0;
@@ -717,12 +1273,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    while ((op = next_request(trace)) != NULL) {
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
@@ -741,8 +1298,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
@@ -763,7 +1320,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -781,7 +1338,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 
@@ -791,8 +1348,9 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    unsigned i, index, size, newsize;
+    unsigned index, size, newsize;
     char *p, *newp, *oldp, *block;
+    traceop_t *op;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
@@ -801,20 +1359,21 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    while ((op = next_request(trace)) != NULL)
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op->index;
+            newsize = op->size;
 	    oldp = trace->blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
@@ -822,7 +1381,7 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             block = trace->blocks[index];
             mm_free(block);
             break;
@@ -832,6 +1391,484 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_threads - Replay trace on 1, 2, 4, ... and finally thread_max
+ *    threads, and print the throughput and per-request latencies of each
+ *    run. The requests of trace thread t go to replay thread t mod n, so
+ *    a block allocated by one trace thread and freed by another is freed
+ *    across threads whenever the two land on different replay threads.
+ *    A trace without thread ops is instead replayed whole by every
+ *    thread, each with its own blocks. The whole trace is held in memory.
+ */
+static void eval_mm_threads(trace_t *trace, int tracenum)
+{
+    replay_t replay;
+    replay_thread_t *threads;
+    lathist_t hist;
+    traceop_t *op;
+    unsigned *count, *all, *last;
+    unsigned i, num_ids;
+    unsigned long cross;
+    int n, t, threaded = 0;
+    struct timespec t0, t1;
+    double secs, tick_ns = lat_tick_ns();
+
+    /* Number each request among those on its id */
+    if ((replay.ops = malloc(trace->num_ops * sizeof(traceop_t))) == NULL ||
+	(replay.seq = malloc(trace->num_ops * sizeof(unsigned))) == NULL ||
+	(all = malloc(trace->num_ops * sizeof(unsigned))) == NULL ||
+	(count = calloc(trace->num_ids, sizeof(unsigned))) == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+    rewind_trace(trace);
+    for (i = 0; (op = next_request(trace)) != NULL; i++) {
+	replay.ops[i] = *op;
+	replay.seq[i] = count[op->index]++;
+	all[i] = i;
+	threaded |= (op->thread != 0);
+    }
+    free(count);
+    if ((threads = malloc(thread_max * sizeof(replay_thread_t))) == NULL ||
+	(last = calloc(trace->num_ids, sizeof(unsigned))) == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+
+    printf("Threaded replay of trace %d, %s:\n", tracenum,
+	   threaded ? "by trace thread" : "one copy per thread");
+    printf("%7s %10s %9s %9s %9s %8s\n",
+	   "threads", "Kops/s", "p50(ns)", "p99(ns)", "p999(ns)", "cross");
+    for (n = 1; n <= thread_max;
+	 n = (n < thread_max && 2 * n > thread_max) ? thread_max : 2 * n) {
+	/* Deal the requests out to the threads */
+	num_ids = threaded ? trace->num_ids : n * trace->num_ids;
+	cross = 0;
+	for (t = 0; t < n; t++) {
+	    threads[t].replay = &replay;
+	    threads[t].base = threaded ? 0 : t * trace->num_ids;
+	    threads[t].num_reqs = threaded ? 0 : trace->num_ops;
+	    threads[t].reqs = threaded ? NULL : all;
+	    lat_clear(&threads[t].hist);
+	}
+	if (threaded) {
+	    for (i = 0; i < trace->num_ops; i++)
+		threads[replay.ops[i].thread % n].num_reqs++;
+	    for (t = 0; t < n; t++) {
+		threads[t].reqs = malloc((threads[t].num_reqs + 1) *
+					 sizeof(unsigned));
+		if (threads[t].reqs == NULL)
+		    unix_error("malloc failed in eval_mm_threads");
+		threads[t].num_reqs = 0;
+	    }
+	    for (i = 0; i < trace->num_ops; i++) {
+		op = &replay.ops[i];
+		t = op->thread % n;
+		threads[t].reqs[threads[t].num_reqs++] = i;
+		if (op->type != ALLOC && last[op->index] != (unsigned)t)
+		    cross++;
+		last[op->index] = t;
+	    }
+	}
+	if ((replay.blocks = calloc(num_ids, sizeof(char *))) == NULL ||
+	    (replay.done = calloc(num_ids, sizeof(unsigned))) == NULL)
+	    unix_error("calloc failed in eval_mm_threads");
+	replay.start = 0;
+
+	/* Reset the heap and run the threads */
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_threads");
+	for (t = 0; t < n; t++) {
+	    if (pthread_create(&threads[t].tid, NULL, replay_thread,
+			       &threads[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_threads");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	__atomic_store_n(&replay.start, 1, __ATOMIC_RELEASE);
+	for (t = 0; t < n; t++)
+	    pthread_join(threads[t].tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (double)(t1.tv_sec - t0.tv_sec) +
+	    (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	lat_clear(&hist);
+	for (t = 0; t < n; t++)
+	    lat_merge(&hist, &threads[t].hist);
+	printf("%7d %10.0f %9.0f %9.0f %9.0f %8lu\n", n,
+	       (double)hist.count / 1e3 / secs,
+	       lat_percentile(&hist, 0.5) * tick_ns,
+	       lat_percentile(&hist, 0.99) * tick_ns,
+	       lat_percentile(&hist, 0.999) * tick_ns, cross);
+
+	if (threaded) {
+	    for (t = 0; t < n; t++)
+		free(threads[t].reqs);
+	}
+	free(replay.blocks);
+	free(replay.done);
+    }
+    free(last);
+    free(threads);
+    free(all);
+    free(replay.seq);
+    free(replay.ops);
+}
+
+/*
+ * replay_thread - Run one thread of a threaded replay, timing each of
+ *    its requests. The wait for the requests that must come first is
+ *    not timed.
+ */
+static void *replay_thread(void *arg)
+{
+    replay_thread_t *self = (replay_thread_t *)arg;
+    replay_t *replay = self->replay;
+    traceop_t *op;
+    unsigned i, id, seq, spins;
+    char *p;
+    uint64_t start;
+
+    while (!__atomic_load_n(&replay->start, __ATOMIC_ACQUIRE))
+	sched_yield();
+    for (i = 0; i < self->num_reqs; i++) {
+	op = &replay->ops[self->reqs[i]];
+	id = self->base + op->index;
+	seq = replay->seq[self->reqs[i]];
+	for (spins = 0;
+	     __atomic_load_n(&replay->done[id], __ATOMIC_ACQUIRE) != seq;
+	     spins++) {
+	    if (spins >= REPLAY_SPINS)
+		sched_yield();
+	}
+
+	start = lat_now();
+	switch (op->type) {
+	case ALLOC:
+	    if ((p = mm_malloc(op->size)) == NULL)
+		app_error("mm_malloc error in replay_thread");
+	    replay->blocks[id] = p;
+	    break;
+	case REALLOC:
+	    if ((p = mm_realloc(replay->blocks[id], op->size)) == NULL)
+		app_error("mm_realloc error in replay_thread");
+	    replay->blocks[id] = p;
+	    break;
+	case FREE:
+	    mm_free(replay->blocks[id]);
+	    break;
+	}
+	lat_record(&self->hist, lat_now() - start);
+	__atomic_store_n(&replay->done[id], seq + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_latency - Replay trace once, timing each request with the
+ *    cycle counter, and print the percentiles of the latencies of each
+ *    type of request in each size class, then the slowest requests. The
+ *    size of a free is the size of the block that it frees. Unlike the
+ *    K-best time of eval_mm_speed, this shows the rare slow requests,
+ *    such as those that extend the heap or scan long free lists.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum)
+{
+    lathist_t *hist, *h;
+    slow_t slow[LAT_SLOWEST];
+    traceop_t *op;
+    unsigned i;
+    int index, size, type, c, j, num_slow = 0;
+    char *p;
+    uint64_t start, ticks;
+    double tick_ns = lat_tick_ns();
+
+    if ((hist = malloc(3 * LAT_CLASSES * sizeof(lathist_t))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+    for (j = 0; j < 3 * LAT_CLASSES; j++)
+	lat_clear(&hist[j]);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    rewind_trace(trace);
+    for (i = 0; (op = next_request(trace)) != NULL; i++) {
+	index = op->index;
+	switch (op->type) {
+	case ALLOC:
+	    size = op->size;
+	    start = lat_now();
+	    p = mm_malloc(size);
+	    ticks = lat_now() - start;
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+	case REALLOC:
+	    size = op->size;
+	    start = lat_now();
+	    p = mm_realloc(trace->blocks[index], size);
+	    ticks = lat_now() - start;
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+	default:
+	    size = (int)trace->block_sizes[index];
+	    start = lat_now();
+	    mm_free(trace->blocks[index]);
+	    ticks = lat_now() - start;
+	    break;
+	}
+	lat_record(&hist[op->type * LAT_CLASSES + lat_class(size)], ticks);
+
+	/* Keep the slowest requests, slowest first */
+	if (num_slow == LAT_SLOWEST && ticks <= slow[num_slow - 1].ticks)
+	    continue;
+	j = (num_slow < LAT_SLOWEST) ? num_slow++ : num_slow - 1;
+	for (; j > 0 && slow[j - 1].ticks < ticks; j--)
+	    slow[j] = slow[j - 1];
+	slow[j].ticks = ticks;
+	slow[j].opnum = i;
+	slow[j].type = op->type;
+	slow[j].size = size;
+    }
+
+    printf("Latency of trace %d, in ns:\n", tracenum);
+    printf("%-8s %7s %9s %8s %8s %8s %8s %9s\n", "request", "size",
+	   "count", "p50", "p90", "p99", "p999", "max");
+    for (type = 0; type < 3; type++) {
+	for (c = 0; c < LAT_CLASSES; c++) {
+	    h = &hist[type * LAT_CLASSES + c];
+	    if (h->count == 0)
+		continue;
+	    printf("%-8s %7s %9llu %8.0f %8.0f %8.0f %8.0f %9.0f\n",
+		   op_names[type], lat_class_names[c],
+		   (unsigned long long)h->count,
+		   lat_percentile(h, 0.5) * tick_ns,
+		   lat_percentile(h, 0.9) * tick_ns,
+		   lat_percentile(h, 0.99) * tick_ns,
+		   lat_percentile(h, 0.999) * tick_ns,
+		   h->max * tick_ns);
+	}
+    }
+    printf("Slowest requests:\n%8s %-8s %9s %9s\n", "line", "request",
+	   "size", "ns");
+    for (j = 0; j < num_slow; j++)
+	printf("%8d %-8s %9d %9.0f\n", LINENUM(slow[j].opnum),
+	       op_names[slow[j].type], slow[j].size, slow[j].ticks * tick_ns);
+    free(hist);
+}
+
+/*
+ * lat_class - Return the latency size class of a request of size bytes
+ */
+static int lat_class(int size)
+{
+    int c;
+
+    for (c = 0; c < LAT_CLASSES - 1 && size > lat_class_max[c]; c++)
+	;
+    return c;
+}
+
+/*
+ * eval_mm_api - Check the routines of the mm package that the traces
+ *     do not call: batches, scoped arenas, aligned blocks and calloc.
+ *     Each block must be aligned, hold its payload and not overlap the
+ *     others, and mm_getstats must count every block once when it is
+ *     allocated and once when it is freed.
+ */
+static void eval_mm_api(void)
+{
+    void *blocks[API_BATCH];
+    char msg[MAXLINE];
+    struct mm_stats st;
+    mm_arena_t *a;
+    size_t s, k, i, n, size, align;
+    size_t num_sizes = sizeof(api_sizes) / sizeof(api_sizes[0]);
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	api_error("mm_init", "failed");
+	return;
+    }
+    api_mallocs = api_frees = 0;
+
+    /* Batches of each size, from slab slots up to mapped blocks */
+    for (s = 0; s < num_sizes; s++) {
+	size = api_sizes[s];
+	n = mm_malloc_batch(size, API_BATCH, blocks);
+	if (n != API_BATCH) {
+	    sprintf(msg, "allocated %lu of %d blocks of %lu bytes",
+		    (unsigned long)n, API_BATCH, (unsigned long)size);
+	    api_error("mm_malloc_batch", msg);
+	}
+	for (i = 0; i < n; i++)
+	    api_fill(blocks[i], size, -1, (int)i + 1, "mm_malloc_batch");
+	for (i = 0; i < n; i++)
+	    api_fill(blocks[i], size, (int)i + 1, 0, "mm_malloc_batch");
+	api_mallocs += n;
+	api_stats("mm_malloc_batch");
+	mm_free_batch(blocks, n);
+	api_frees += n;
+	api_stats("mm_free_batch");
+    }
+
+    /*
+     * Scoped arenas, with the default chunks and with small ones, reset
+     * once and then destroyed
+     */
+    for (k = 0; k < 2; k++) {
+	if ((a = mm_arena_create(k * 4096)) == NULL) {
+	    api_error("mm_arena_create", "failed");
+	    break;
+	}
+	for (n = 0; n < 2; n++) {
+	    for (i = 0; i < API_BATCH; i++) {
+		size = api_sizes[i % num_sizes] + i;
+		if ((blocks[i] = mm_arena_alloc(a, size)) == NULL) {
+		    api_error("mm_arena_alloc", "failed");
+		    break;
+		}
+		api_fill(blocks[i], size, -1, (int)i + 1, "mm_arena_alloc");
+	    }
+	    while (i-- > 0)
+		api_fill(blocks[i], api_sizes[i % num_sizes] + i, (int)i + 1,
+			 0, "mm_arena_alloc");
+	    mm_arena_reset(a);
+	}
+	mm_arena_destroy(a);
+
+	/* The arena and its chunks must all have been freed */
+	mm_getstats(&st);
+	n = st.nmalloc - api_mallocs;
+	if (n < 2)
+	    api_error("mm_arena_alloc", "no chunks came from mm_malloc");
+	api_mallocs += n;
+	api_frees += n;
+	api_stats("mm_arena_destroy");
+    }
+
+    /* Aligned blocks, from the heap and mapped */
+    for (k = 0; k < sizeof(api_aligns) / sizeof(api_aligns[0]); k++) {
+	align = api_aligns[k];
+	for (s = 0; s < num_sizes; s++) {
+	    size = api_sizes[s];
+	    blocks[s] = (s % 2) ? mm_aligned_alloc(align, size) :
+		mm_memalign(align, size);
+	    if (blocks[s] == NULL) {
+		api_error("mm_memalign", "failed");
+		continue;
+	    }
+	    api_mallocs++;
+	    if ((uintptr_t)blocks[s] % align != 0) {
+		sprintf(msg, "%p is not aligned to %lu bytes", blocks[s],
+			(unsigned long)align);
+		api_error("mm_memalign", msg);
+	    }
+	    if (mm_usable_size(blocks[s]) < size) {
+		sprintf(msg, "%p has %lu usable bytes, not %lu", blocks[s],
+			(unsigned long)mm_usable_size(blocks[s]),
+			(unsigned long)size);
+		api_error("mm_usable_size", msg);
+	    }
+	    api_fill(blocks[s], size, -1, (int)s + 1, "mm_memalign");
+	}
+	api_stats("mm_memalign");
+	for (s = 0; s < num_sizes; s++) {
+	    if (blocks[s] == NULL)
+		continue;
+	    api_fill(blocks[s], api_sizes[s], (int)s + 1, 0, "mm_memalign");
+	    mm_free(blocks[s]);
+	    api_frees++;
+	}
+	api_stats("mm_free");
+    }
+
+    /*
+     * Cleared blocks, twice over, so that the second round reuses the
+     * memory that the first one dirtied
+     */
+    for (k = 0; k < 2; k++) {
+	for (s = 0; s < num_sizes; s++) {
+	    size = api_sizes[s];
+	    for (i = 0; i < API_BATCH / 4; i++) {
+		if ((blocks[i] = mm_calloc(i + 1, size)) == NULL) {
+		    api_error("mm_calloc", "failed");
+		    break;
+		}
+		api_fill(blocks[i], (i + 1) * size, 0, (int)i + 1,
+			 "mm_calloc");
+		api_mallocs++;
+	    }
+	    api_stats("mm_calloc");
+	    while (i-- > 0) {
+		mm_free(blocks[i]);
+		api_frees++;
+	    }
+	    api_stats("mm_free");
+	}
+    }
+    if (mm_calloc(SIZE_MAX / 2 + 1, 2) != NULL)
+	api_error("mm_calloc", "an overflowing size was allocated");
+    api_stats("mm_calloc");
+}
+
+/*
+ * api_fill - Check that the size bytes of the block at p, from the
+ *     routine what, all read old, unless old is -1, then fill them
+ *     with new
+ */
+static void api_fill(char *p, size_t size, int old, int new, char *what)
+{
+    char msg[MAXLINE];
+    unsigned char *q = (unsigned char *)p;
+    size_t i;
+
+    if (!IS_ALIGNED(p)) {
+	sprintf(msg, "payload %p is not aligned to %d bytes", p, ALIGNMENT);
+	api_error(what, msg);
+	return;
+    }
+    for (i = 0; old >= 0 && i < size; i++) {
+	if (q[i] != old) {
+	    sprintf(msg, "byte %lu of the %lu at %p is %d, not %d",
+		    (unsigned long)i, (unsigned long)size, p, q[i], old);
+	    api_error(what, msg);
+	    break;
+	}
+    }
+    memset(p, new, size);
+}
+
+/*
+ * api_stats - Check that mm_getstats has counted the blocks that the
+ *     API check allocated and freed up to the call of the routine what,
+ *     and that the heap is consistent
+ */
+static void api_stats(char *what)
+{
+    char msg[MAXLINE];
+    struct mm_stats st;
+
+    mm_getstats(&st);
+    if (st.nmalloc != api_mallocs || st.nfree != api_frees) {
+	sprintf(msg, "mm_getstats counts %lu mallocs and %lu frees, not "
+		"%lu and %lu", st.nmalloc, st.nfree, api_mallocs, api_frees);
+	api_error(what, msg);
+    }
+    if ((api_mallocs == api_frees) != (st.in_use == 0)) {
+	sprintf(msg, "mm_getstats counts %lu bytes in use with %lu blocks "
+		"live", (unsigned long)st.in_use, api_mallocs - api_frees);
+	api_error(what, msg);
+    }
+    if (mm_checkheap(MM_CHECK_LISTS) > 0)
+	api_error(what, "mm_checkheap found errors");
+    api_mallocs = st.nmalloc;
+    api_frees = st.nfree;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -842,30 +1879,32 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 {
     unsigned i, newsize;
     char *p, *newp, *oldp;
+    traceop_t *op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    for (i = 0;  (op = next_request(trace)) != NULL;  i++) {
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op->index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+	    oldp = trace->blocks[op->index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op->index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op->index]);
 	    break;
 
 	default:
@@ -883,24 +1922,25 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    unsigned i;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
+    traceop_t *op;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    while ((op = next_request(trace)) != NULL) {
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -909,7 +1949,7 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
@@ -922,6 +1962,38 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * count_node - classify the block at p, which has just been written, as
+ *     local or remote by the NUMA node its first page landed on
+ */
+static void count_node(char *p)
+{
+    int node = mem_node_of(p);
+
+    if (node < 0 || node == mem_numa_node())
+	node_local++;
+    else
+	node_remote++;
+}
+
+/*
+ * print_mm_stats - print the mm package's statistics, which after a
+ *     speed test cover the last run of the trace
+ */
+static void print_mm_stats(void)
+{
+    struct mm_stats st;
+
+    mm_getstats(&st);
+    printf("  %lu mallocs, %lu frees, %lu reallocs (%lu in place), "
+	   "%lu extensions, %.2f probes per fit\n",
+	   st.nmalloc, st.nfree, st.nrealloc, st.nrealloc_inplace,
+	   st.nextend, st.probe_avg);
+    printf("  heap %lu bytes (peak %lu), %lu in use, %lu free\n",
+	   (unsigned long)st.heap_size, (unsigned long)st.heap_peak,
+	   (unsigned long)st.in_use, (unsigned long)st.free_bytes);
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -979,6 +2051,45 @@ static void printresults(int n, stats_t *stats)
 	       "-");
     }
 
+    print_counts(n, stats);
+}
+
+/*
+ * print_counts - Print the hardware events per request of each trace
+ *     whose timed runs were counted, with "-" for events the machine
+ *     does not count
+ */
+static void print_counts(int n, stats_t *stats)
+{
+    static char *names[FPERF_EVENTS] = {
+	"cycles", "insns", "llc-miss", "tlb-miss", "br-miss", "faults"
+    };
+    double *c;
+    int i, e, header = 0;
+
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || !stats[i].counted)
+	    continue;
+	if (!header) {
+	    printf("Events per request:\n%5s", "trace");
+	    for (e = 0; e < FPERF_EVENTS; e++)
+		printf("%10s", names[e]);
+	    printf("%6s\n", "IPC");
+	    header = 1;
+	}
+	c = stats[i].counts;
+	printf("%2d   ", i);
+	for (e = 0; e < FPERF_EVENTS; e++) {
+	    if (c[e] < 0)
+		printf("%10s", "-");
+	    else
+		printf("%10.3f", c[e] / stats[i].ops);
+	}
+	if (c[FPERF_CYCLES] > 0 && c[FPERF_INSNS] >= 0)
+	    printf("%6.2f\n", c[FPERF_INSNS] / c[FPERF_CYCLES]);
+	else
+	    printf("%6s\n", "-");
+    }
 }
 
 /* 
@@ -999,6 +2110,15 @@ void unix_error(char *msg)
     exit(1);
 }
 
+/*
+ * api_error - Report an error found by the API check in the routine what
+ */
+void api_error(char *what, char *msg)
+{
+    errors++;
+    printf("ERROR [API, %s]: %s\n", what, msg);
+}
+
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
@@ -1013,14 +2133,23 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVAal] [-c <level>] [-f <file>] [-t <dir>] [-H <mode>]\n"
+	    "               [-j <jobs>] [-L] [-M <timer>] [-P <cpus>] [-T <threads>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A         Also check the batch, arena, memalign and calloc routines.\n");
+    fprintf(stderr, "\t-c <level> Check the heap at <level> after each request.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <mode>  Back the heap with pages, thp or hugetlb.\n");
+    fprintf(stderr, "\t-j <jobs>  Evaluate up to <jobs> traces at once, 0 for one per CPU.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print the latency of each kind of request.\n");
+    fprintf(stderr, "\t-M <timer> Time with fcyc, itimer, gettod or perf (counters).\n");
+    fprintf(stderr, "\t-P <cpus>  Pin the -j workers to <cpus>, e.g. 2-5,7 or isolated.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on up to <n> threads.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
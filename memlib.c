@@ -3,35 +3,206 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The model is a set of MEM_REGIONS independent heaps, each MEM_REGION_MAX
+ * bytes and with its own brk pointer, carved from one reservation so
+ * that the region owning an address is found by division.  Region 0
+ * is the classic heap that mem_sbrk and mem_heap_lo/hi operate on.
+ *
+ * Large blocks may instead live in separate mappings made with mem_map,
+ * which lie outside every region and are returned to the OS by
+ * mem_unmap.  Both kinds of memory count towards the heap size.  The live
+ * mappings are kept in a tree ordered by start address, a treap whose
+ * priorities are a hash of the start, so that finding the mapping that
+ * starts at or contains an address takes logarithmic time however many
+ * there are.
+ *
+ * The regions are backed by base pages, by transparent huge pages, or
+ * by pages from the hugetlb pool, as chosen by mem_init_backing.  Each
+ * region starts on a huge page boundary.  Pages are committed lazily as
+ * the brk advances: by the first touch for base and transparent huge
+ * pages, and by mapping whole huge pages over the reservation for hugetlb.
+ *
+ * Each region remembers the highest its brk has been since its pages were
+ * last decommitted.  Memory above that mark has never been handed out, so
+ * it reads as zero, which lets calloc skip clearing it.
+ *
+ * On a NUMA machine a region may be bound to a node, so that its pages
+ * are placed there rather than on the node that first touches them.  The
+ * NUMA routines use the raw system calls, so no libnuma is needed, and
+ * they all behave as if there were a single node where it is missing.
+ *
+ * Nothing here calls malloc or stdio on the way to memory, so that the
+ * model can also serve a malloc that replaces the system's (mmshim.c).
+ * Such a build raises MEM_REGION_MAX from the driver's MAX_HEAP to the
+ * size of a real process's heap; the reservation costs only address space.
+ */
+
+/* bytes in each region */
+#ifndef MEM_REGION_MAX
+#define MEM_REGION_MAX MAX_HEAP
+#endif
+
+/* memory policy constants, from <numaif.h> */
+#define MEM_MPOL_PREFERRED 1       /* mode: allocate on the node if we can */
+#define MEM_MPOL_F_NODE    (1 << 0) /* get_mempolicy: return a node */
+#define MEM_MPOL_F_ADDR    (1 << 1) /* get_mempolicy: ... of this address */
+#define MEM_MPOL_MF_MOVE   (1 << 1) /* mbind: migrate pages already there */
+
+#define MEM_MAPS_MIN 256           /* smallest number of mapping nodes */
+
+/*
+ * a live mapping made by mem_map, as a node of the tree of mappings, or
+ * a free node if start is NULL.  Nodes link by index, so that the array
+ * of them may move as it grows.
+ */
+struct mem_mapping {
+    char *start;
+    size_t size;
+    long left;                 /* subtree of lower starts, or next free */
+    long right;                /* subtree of higher starts */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_start_brk;  /* points to first byte of all the regions */
+static char *mem_max_addr;   /* largest legal address of the last region */ 
+static char *mem_brk[MEM_REGIONS]; /* points to last byte of each region */
+static char *mem_commit[MEM_REGIONS]; /* end of each region's mapped pages */
+static char *mem_fresh[MEM_REGIONS]; /* each region reads zero from here up */
+static size_t mem_stride;    /* distance between region starts */
+static size_t mem_reserved;  /* size of the reservation for the regions */
+static int mem_node[MEM_REGIONS]; /* node each region is bound to, or -1 */
+static int mem_nnodes;       /* number of NUMA nodes, once known */
+static int mem_mode;         /* how the regions are backed */
+static size_t mem_size;      /* bytes in use by all regions and mappings */
+static size_t mem_peak;      /* largest value of mem_size since the reset */
+
+static struct mem_mapping *mem_maps; /* nodes of the mapping tree */
+static size_t mem_maxmaps;   /* number of nodes in mem_maps */
+static long mem_maps_root = -1; /* root node of the tree, or -1 */
+static long mem_maps_free = -1; /* first free node, or -1 */
+static pthread_mutex_t mem_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *mem_backing_names[] = { "pages", "thp", "hugetlb" };
+
+static void mem_grow(size_t incr);
+static size_t mem_decommit_unit(const void *p);
+static long mem_find_map(const char *p);
+static long mem_map_below(const char *p);
+static int mem_add_map(char *p, size_t size);
+static void mem_drop_map(long i);
+static long mem_insert_map(long t, long i);
+static long mem_remove_map(long t, const char *p);
+static long mem_join_maps(long a, long b);
+static uintptr_t mem_map_prio(const char *p);
+static void mem_free_maps(size_t lo, size_t hi);
+static int mem_commit_huge(int region, char *brk);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model, backed by base pages
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    mem_init_backing(MEM_BACKING_PAGES);
+}
+
+/*
+ * mem_init_backing - initialize the memory system model with the regions
+ *    backed as backing says.  Falls back to hugetlb's next best thing,
+ *    transparent huge pages, if the hugetlb pool is empty, and to base
+ *    pages if transparent huge pages are unavailable.  Returns the
+ *    backing in effect.
+ */
+int mem_init_backing(int backing)
+{
+    char *base, *probe;
+    size_t excess;
+    int i;
+
+    /* try to get one huge page from the pool for hugetlb */
+    if (backing == MEM_BACKING_HUGETLB) {
+	probe = mmap(NULL, MEM_HUGEPAGE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (probe == MAP_FAILED)
+	    backing = MEM_BACKING_THP;
+	else
+	    munmap(probe, MEM_HUGEPAGE);
+    }
+
+    /* 
+     * reserve the storage we will use to model the available VM, with
+     * room to align its start to a huge page.  Hugetlb pages are mapped
+     * over the reservation as they are needed.
+     */
+    mem_stride = ((size_t)MEM_REGION_MAX + MEM_HUGEPAGE - 1) &
+		 ~(size_t)(MEM_HUGEPAGE - 1);
+    mem_reserved = (size_t)MEM_REGIONS * mem_stride;
+    base = mmap(NULL, mem_reserved + MEM_HUGEPAGE,
+		(backing == MEM_BACKING_HUGETLB) ? PROT_NONE :
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = (char *)(((uintptr_t)base + MEM_HUGEPAGE - 1) &
+			     ~(uintptr_t)(MEM_HUGEPAGE - 1));
+    if (mem_start_brk > base)
+	munmap(base, (size_t)(mem_start_brk - base));
+    excess = (size_t)(base + MEM_HUGEPAGE - mem_start_brk);
+    if (excess > 0)
+	munmap(mem_start_brk + mem_reserved, excess);
+
+    if (backing == MEM_BACKING_THP &&
+	madvise(mem_start_brk, mem_reserved, MADV_HUGEPAGE) != 0)
+	backing = MEM_BACKING_PAGES;
+    mem_mode = backing;
+
+    /* max legal heap address */
+    mem_max_addr = mem_start_brk + mem_reserved;
+    for (i = 0; i < MEM_REGIONS; i++) {  /* heaps are empty initially */
+	mem_brk[i] = mem_start_brk + (size_t)i * mem_stride;
+	mem_commit[i] = (backing == MEM_BACKING_HUGETLB) ? mem_brk[i] :
+			mem_brk[i] + mem_stride;
+	mem_fresh[i] = mem_brk[i];
+	mem_node[i] = -1;
+    }
+    mem_size = mem_peak = 0;
+    return mem_mode;
+}
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+/*
+ * mem_backing - return how the regions are backed
+ */
+int mem_backing(void)
+{
+    return mem_mode;
+}
+
+/*
+ * mem_backing_name - return the name of backing, as the driver spells it
+ */
+const char *mem_backing_name(int backing)
+{
+    if (backing < 0 || backing > MEM_BACKING_HUGETLB)
+	return "unknown";
+    return mem_backing_names[backing];
 }
 
 /* 
@@ -39,35 +210,281 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, mem_reserved);
+    if (mem_maps != NULL)
+	munmap(mem_maps, mem_maxmaps * sizeof(*mem_maps));
+    mem_maps = NULL;
+    mem_maxmaps = 0;
+    mem_maps_free = -1;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty heaps,
+ *    and unmap every live mapping
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    size_t i;
+
+    for (i = 0; i < MEM_REGIONS; i++)
+	mem_brk[i] = mem_start_brk + i * mem_stride;
+    for (i = 0; i < mem_maxmaps; i++) {
+	if (mem_maps[i].start != NULL)
+	    munmap(mem_maps[i].start, mem_maps[i].size);
+    }
+    mem_maps_root = mem_maps_free = -1;
+    mem_free_maps(0, mem_maxmaps);
+    mem_size = mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, decommitting the released pages
+ *    and any others above the new brk that were ever handed out.
  */
 void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for the heap in region "region". Each
+ *    region's brk is independent, so callers that own disjoint regions
+ *    may extend them concurrently.
+ */
+void *mem_region_sbrk(int region, intptr_t incr)
+{
+    char *old_brk = mem_brk[region];
+    char *min_addr = mem_start_brk + (size_t)region * mem_stride;
+    char *max_addr = min_addr + MEM_REGION_MAX;
+    size_t unit;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0) {
+	if (old_brk + incr < min_addr) {
+	    errno = EINVAL;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Shrank below start...\n");
+	    return (void *)-1;
+	}
+	mem_brk[region] += incr;
+	unit = mem_decommit_unit(mem_brk[region]);
+	mem_fresh[region] = (char *)(((uintptr_t)mem_fresh[region] + unit - 1) &
+				     ~(uintptr_t)(unit - 1));
+	mem_decommit(mem_brk[region],
+		     (size_t)(mem_fresh[region] - mem_brk[region]));
+	mem_fresh[region] = (char *)(((uintptr_t)mem_brk[region] + unit - 1) &
+				     ~(uintptr_t)(unit - 1));
+	__atomic_sub_fetch(&mem_size, (size_t)-incr, __ATOMIC_RELAXED);
+	return (void *)old_brk;
+    }
+    if ((old_brk + incr) > max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+    if (old_brk + incr > mem_commit[region] &&
+	mem_commit_huge(region, old_brk + incr) < 0) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of huge pages...\n");
+	return (void *)-1;
+    }
+    mem_brk[region] += incr;
+    if (mem_brk[region] > mem_fresh[region])
+	mem_fresh[region] = mem_brk[region];
+    mem_grow((size_t)incr);
     return (void *)old_brk;
 }
 
+/*
+ * mem_region_fresh - return the address from which region "region" reads
+ *    as zero: nothing at or above it has been below the brk since its
+ *    pages were last decommitted.  Memory that mem_region_sbrk returns is
+ *    zero from this address on, if it was read before the call.
+ */
+void *mem_region_fresh(int region)
+{
+    return (void *)mem_fresh[region];
+}
+
+/*
+ * mem_decommit - give the pages that lie wholly within the size bytes at
+ *    p back to the system.  The bytes stay addressable, but their contents
+ *    are lost: they read as zero until they are written again.  Hugetlb
+ *    pages go back only as whole huge pages.
+ */
+void mem_decommit(void *p, size_t size)
+{
+    size_t pagesize = mem_decommit_unit(p);
+    char *lo = (char *)(((uintptr_t)p + pagesize - 1) & ~(pagesize - 1));
+    char *hi = (char *)(((uintptr_t)p + size) & ~(pagesize - 1));
+
+    if (hi > lo)
+	madvise(lo, (size_t)(hi - lo), MADV_DONTNEED);
+}
+
+/*
+ * mem_map - map a new, zero-filled area of size bytes, a multiple of the
+ *    page size, outside every region.  Returns its start address, or NULL
+ *    if the system is out of memory.  Safe to call from any thread.
+ */
+void *mem_map(size_t size)
+{
+    return mem_map_aligned(size, mem_pagesize(), 0);
+}
+
+/*
+ * mem_map_aligned - mem_map for an area whose start plus offset is a
+ *    multiple of align, a power of two.  offset is a multiple of the page
+ *    size and less than align, if align exceeds the page size.  The
+ *    excess mapped to find such an area is unmapped right away.
+ */
+void *mem_map_aligned(size_t size, size_t align, size_t offset)
+{
+    size_t pagesize = mem_pagesize();
+    size_t extra = (align > pagesize) ? align - pagesize : 0;
+    char *base, *p;
+
+    base = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    p = base;
+    if (extra > 0) {
+	p = (char *)((((uintptr_t)base + offset + align - 1) & ~(align - 1)) -
+		     offset);
+	if (p > base)
+	    munmap(base, (size_t)(p - base));
+	if (base + extra > p)
+	    munmap(p + size, (size_t)(base + extra - p));
+    }
+
+    pthread_mutex_lock(&mem_maps_lock);
+    if (mem_add_map(p, size) < 0) {
+	pthread_mutex_unlock(&mem_maps_lock);
+	munmap(p, size);
+	return NULL;
+    }
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    mem_grow(size);
+    return (void *)p;
+}
+
+/*
+ * mem_unmap - return the mapping that starts at p, made by mem_map or
+ *    mem_remap, to the system
+ */
+void mem_unmap(void *p)
+{
+    size_t size;
+    long i;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    i = mem_find_map(p);
+    assert(i >= 0);
+    size = mem_maps[i].size;
+    mem_drop_map(i);
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    munmap(p, size);
+    __atomic_sub_fetch(&mem_size, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_remap - resize the mapping that starts at p to size bytes, a
+ *    multiple of the page size, moving it if need be.  Returns its new
+ *    start address, or NULL (leaving the mapping alone) if it cannot be
+ *    resized.
+ */
+void *mem_remap(void *p, size_t size)
+{
+    size_t oldsize;
+    char *newp;
+    long i;
+
+    pthread_mutex_lock(&mem_maps_lock);
+    i = mem_find_map(p);
+    assert(i >= 0);
+    oldsize = mem_maps[i].size;
+    newp = mremap(p, oldsize, size, MREMAP_MAYMOVE);
+    if (newp == MAP_FAILED) {
+	pthread_mutex_unlock(&mem_maps_lock);
+	return NULL;
+    }
+    if (newp == (char *)p)
+	mem_maps[i].size = size;
+    else {
+	/* a moved mapping takes another place in the tree */
+	mem_maps_root = mem_remove_map(mem_maps_root, p);
+	mem_maps[i].start = newp;
+	mem_maps[i].size = size;
+	mem_maps_root = mem_insert_map(mem_maps_root, i);
+    }
+    pthread_mutex_unlock(&mem_maps_lock);
+
+    if (size > oldsize)
+	mem_grow(size - oldsize);
+    else
+	__atomic_sub_fetch(&mem_size, oldsize - size, __ATOMIC_RELAXED);
+    return (void *)newp;
+}
+
+/*
+ * mem_region_of - return the region that contains address p, or -1 if
+ *    p lies outside every region
+ */
+int mem_region_of(const void *p)
+{
+    const char *cp = (const char *)p;
+
+    if (cp < mem_start_brk || cp >= mem_max_addr)
+	return -1;
+    return (int)((size_t)(cp - mem_start_brk) / mem_stride);
+}
+
+/*
+ * mem_is_heap - return true if the bytes lo..hi all lie within the part
+ *    of a single region that has been handed out by mem_region_sbrk, or
+ *    within a single live mapping
+ */
+int mem_is_heap(const void *lo, const void *hi)
+{
+    int region = mem_region_of(lo);
+    long i;
+    int ok;
+
+    if ((const char *)hi < (const char *)lo)
+	return 0;
+    if (region >= 0)
+	return ((const char *)hi < mem_brk[region]);
+
+    /* a block need not start its mapping: find the last one below it */
+    pthread_mutex_lock(&mem_maps_lock);
+    i = mem_map_below(lo);
+    ok = (i >= 0 && (const char *)hi < mem_maps[i].start + mem_maps[i].size);
+    pthread_mutex_unlock(&mem_maps_lock);
+    return ok;
+}
+
+/*
+ * mem_prefork - take the lock of the mapping table before a fork, so that
+ *    the child does not inherit it held by a thread that is gone
+ */
+void mem_prefork(void)
+{
+    pthread_mutex_lock(&mem_maps_lock);
+}
+
+/*
+ * mem_postfork - release the lock taken by mem_prefork, in the parent
+ *    and in the child
+ */
+void mem_postfork(void)
+{
+    pthread_mutex_unlock(&mem_maps_lock);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,15 +498,25 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(mem_brk[0] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the total size in bytes of all the heaps and
+ *    live mappings
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return __atomic_load_n(&mem_size, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_heap_peak() - returns the largest value of mem_heapsize() since
+ *    the heaps were last reset
+ */
+size_t mem_heap_peak()
+{
+    return __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
 }
 
 /*
@@ -99,3 +526,325 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_numa_nodes - returns the number of NUMA nodes of the system, at
+ *    least 1.  Nodes are numbered from 0.
+ */
+int mem_numa_nodes(void)
+{
+    char buf[256], *p, *end;
+    ssize_t n;
+    long lo, hi;
+    int fd;
+
+    if (mem_nnodes > 0)
+	return mem_nnodes;
+
+    /*
+     * the online node list reads like "0" or "0-1"; read it raw, as
+     * stdio would allocate
+     */
+    hi = 0;
+    if ((fd = open("/sys/devices/system/node/online", O_RDONLY)) >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[n > 0 ? n : 0] = '\0';
+	for (p = buf; ; p = end + 1) {
+	    lo = strtol(p, &end, 10);
+	    if (end == p)
+		break;
+	    if (lo > hi)
+		hi = lo;
+	    if (*end != ',' && *end != '-')
+		break;
+	}
+    }
+    mem_nnodes = (int)hi + 1;
+    return mem_nnodes;
+}
+
+/*
+ * mem_numa_node - returns the node of the CPU the caller runs on
+ */
+int mem_numa_node(void)
+{
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+	return 0;
+    return (int)node;
+}
+
+/*
+ * mem_node_of - returns the node that holds the page at p, or -1 if p
+ *    is not mapped or the system cannot tell
+ */
+int mem_node_of(const void *p)
+{
+    int node;
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, p,
+		MEM_MPOL_F_NODE | MEM_MPOL_F_ADDR) != 0)
+	return -1;
+    return node;
+}
+
+/*
+ * mem_bind - prefer node for the pages that the size bytes at p touch,
+ *    moving those that are already elsewhere.  Returns 0 on success and
+ *    -1 if the system refuses.
+ */
+int mem_bind(void *p, size_t size, int node)
+{
+    size_t pagesize = mem_pagesize();
+    uintptr_t lo = (uintptr_t)p & ~(pagesize - 1);
+    uintptr_t hi = ((uintptr_t)p + size + pagesize - 1) & ~(pagesize - 1);
+    unsigned long mask[4] = { 0 };
+    size_t bits = 8 * sizeof(mask[0]);
+
+    if (node < 0 || (size_t)node >= 4 * bits)
+	return -1;
+    mask[node / bits] = 1UL << (node % bits);
+    if (syscall(SYS_mbind, lo, hi - lo, MEM_MPOL_PREFERRED, mask,
+		4 * bits, MEM_MPOL_MF_MOVE) != 0)
+	return -1;
+    return 0;
+}
+
+/*
+ * mem_region_bind - bind region to node, pages to come included.  With a
+ *    single node, there is nothing to do.  Returns 0 on success and -1 if
+ *    the system refuses.
+ */
+int mem_region_bind(int region, int node)
+{
+    if (mem_numa_nodes() == 1)
+	return 0;
+    mem_node[region] = node;
+    return mem_bind(mem_start_brk + (size_t)region * mem_stride, mem_stride,
+		    node);
+}
+
+/*
+ * mem_grow - account for incr more bytes of heap, updating the peak
+ */
+static void mem_grow(size_t incr)
+{
+    size_t size = __atomic_add_fetch(&mem_size, incr, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (size > peak &&
+	   !__atomic_compare_exchange_n(&mem_peak, &peak, size, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * mem_decommit_unit - return the size of the pages that mem_decommit gives
+ *    back at p
+ */
+static size_t mem_decommit_unit(const void *p)
+{
+    return (mem_mode == MEM_BACKING_HUGETLB && mem_region_of(p) >= 0) ?
+	MEM_HUGEPAGE : mem_pagesize();
+}
+
+/*
+ * mem_find_map - return the node of the live mapping that starts at p,
+ *    or -1 if there is none.  The caller holds mem_maps_lock.
+ */
+static long mem_find_map(const char *p)
+{
+    long t = mem_maps_root;
+
+    while (t >= 0 && mem_maps[t].start != p)
+	t = (p < mem_maps[t].start) ? mem_maps[t].left : mem_maps[t].right;
+    return t;
+}
+
+/*
+ * mem_map_below - return the node of the live mapping with the highest
+ *    start at or below p, the only one that may contain p, or -1 if
+ *    there is none.  The caller holds mem_maps_lock.
+ */
+static long mem_map_below(const char *p)
+{
+    long t = mem_maps_root, best = -1;
+
+    while (t >= 0) {
+	if (mem_maps[t].start <= p) {
+	    best = t;
+	    t = mem_maps[t].right;
+	} else
+	    t = mem_maps[t].left;
+    }
+    return best;
+}
+
+/*
+ * mem_add_map - add a mapping of size bytes that starts at p to the
+ *    tree, doubling the array of nodes if none is free.  The array is
+ *    mapped, not malloc'ed, for the shim's sake.  Returns 0 on success
+ *    and -1 if the system is out of memory.  The caller holds
+ *    mem_maps_lock.
+ */
+static int mem_add_map(char *p, size_t size)
+{
+    struct mem_mapping *maps;
+    size_t maxmaps;
+    long i;
+
+    if (mem_maps_free < 0) {
+	maxmaps = mem_maxmaps ? 2 * mem_maxmaps : MEM_MAPS_MIN;
+	maps = (mem_maps == NULL) ?
+	    mmap(NULL, maxmaps * sizeof(*maps), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+	    mremap(mem_maps, mem_maxmaps * sizeof(*maps),
+		   maxmaps * sizeof(*maps), MREMAP_MAYMOVE);
+	if (maps == MAP_FAILED)
+	    return -1;
+	mem_maps = maps;
+	mem_free_maps(mem_maxmaps, maxmaps);
+	mem_maxmaps = maxmaps;
+    }
+    i = mem_maps_free;
+    mem_maps_free = mem_maps[i].left;
+    mem_maps[i].start = p;
+    mem_maps[i].size = size;
+    mem_maps_root = mem_insert_map(mem_maps_root, i);
+    return 0;
+}
+
+/*
+ * mem_drop_map - remove node i from the tree and free it.  The caller
+ *    holds mem_maps_lock.
+ */
+static void mem_drop_map(long i)
+{
+    mem_maps_root = mem_remove_map(mem_maps_root, mem_maps[i].start);
+    mem_maps[i].start = NULL;
+    mem_maps[i].left = mem_maps_free;
+    mem_maps_free = i;
+}
+
+/*
+ * mem_insert_map - insert node i, which links to nothing, into the
+ *    subtree t, and return the subtree's new root.  A node of higher
+ *    priority is rotated above its parent.
+ */
+static long mem_insert_map(long t, long i)
+{
+    struct mem_mapping *x = &mem_maps[i];
+    long c;
+
+    if (t < 0) {
+	x->left = x->right = -1;
+	return i;
+    }
+    if (x->start < mem_maps[t].start) {
+	c = mem_maps[t].left = mem_insert_map(mem_maps[t].left, i);
+	if (mem_map_prio(mem_maps[c].start) > mem_map_prio(mem_maps[t].start)) {
+	    mem_maps[t].left = mem_maps[c].right;
+	    mem_maps[c].right = t;
+	    return c;
+	}
+    } else {
+	c = mem_maps[t].right = mem_insert_map(mem_maps[t].right, i);
+	if (mem_map_prio(mem_maps[c].start) > mem_map_prio(mem_maps[t].start)) {
+	    mem_maps[t].right = mem_maps[c].left;
+	    mem_maps[c].left = t;
+	    return c;
+	}
+    }
+    return t;
+}
+
+/*
+ * mem_remove_map - remove the node of the mapping that starts at p,
+ *    which is in the subtree t, and return the subtree's new root
+ */
+static long mem_remove_map(long t, const char *p)
+{
+    if (mem_maps[t].start == p)
+	return mem_join_maps(mem_maps[t].left, mem_maps[t].right);
+    if (p < mem_maps[t].start)
+	mem_maps[t].left = mem_remove_map(mem_maps[t].left, p);
+    else
+	mem_maps[t].right = mem_remove_map(mem_maps[t].right, p);
+    return t;
+}
+
+/*
+ * mem_join_maps - join the subtrees a and b, every start in a being
+ *    lower than every start in b, and return the root of the result
+ */
+static long mem_join_maps(long a, long b)
+{
+    if (a < 0)
+	return b;
+    if (b < 0)
+	return a;
+    if (mem_map_prio(mem_maps[a].start) > mem_map_prio(mem_maps[b].start)) {
+	mem_maps[a].right = mem_join_maps(mem_maps[a].right, b);
+	return a;
+    }
+    mem_maps[b].left = mem_join_maps(a, mem_maps[b].left);
+    return b;
+}
+
+/*
+ * mem_map_prio - return the treap priority of a mapping that starts at
+ *    p: a mix of its page number, so that the tree stays balanced in
+ *    expectation whatever order the mappings come and go in
+ */
+static uintptr_t mem_map_prio(const char *p)
+{
+    uint64_t x = (uint64_t)((uintptr_t)p >> 12);
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (uintptr_t)x;
+}
+
+/*
+ * mem_free_maps - push nodes lo..hi-1 onto the free list, lowest first
+ */
+static void mem_free_maps(size_t lo, size_t hi)
+{
+    while (hi > lo) {
+	hi--;
+	mem_maps[hi].start = NULL;
+	mem_maps[hi].left = mem_maps_free;
+	mem_maps_free = (long)hi;
+    }
+}
+
+/*
+ * mem_commit_huge - map huge pages from the hugetlb pool over the part of
+ *    region that lies below brk and is not yet committed.  The other
+ *    backings map each region whole, to be committed on first touch.
+ *    Returns 0 on success and -1 if the pool runs dry.
+ */
+static int mem_commit_huge(int region, char *brk)
+{
+    char *end = (char *)(((uintptr_t)brk + MEM_HUGEPAGE - 1) &
+			 ~(uintptr_t)(MEM_HUGEPAGE - 1));
+    char *p;
+
+    p = mmap(mem_commit[region], (size_t)(end - mem_commit[region]),
+	     PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED)
+	return -1;
+
+    /* the new mapping replaced the old one's policy */
+    if (mem_node[region] >= 0)
+	mem_bind(mem_commit[region], (size_t)(end - mem_commit[region]),
+		 mem_node[region]);
+    mem_commit[region] = end;
+    return 0;
+}
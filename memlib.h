@@ -1,8 +1,41 @@
+/* Number of independent heap regions modeled by memlib.c */
+#ifndef MEM_REGIONS
+#define MEM_REGIONS 16
+#endif
+
+/* Ways of backing the heap regions, for mem_init_backing */
+#define MEM_BACKING_PAGES   0  /* base pages, as the system hands them out */
+#define MEM_BACKING_THP     1  /* transparent huge pages, by madvise */
+#define MEM_BACKING_HUGETLB 2  /* huge pages from the hugetlb pool */
+
+/* Huge page size (bytes); each region starts on a huge page boundary */
+#define MEM_HUGEPAGE (2 * 1024 * 1024)
+
 void mem_init(void);               
+int mem_init_backing(int backing);
+int mem_backing(void);
+const char *mem_backing_name(int backing);
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_fresh(int region);
+int mem_region_of(const void *p);
+int mem_is_heap(const void *lo, const void *hi);
+void mem_prefork(void);
+void mem_postfork(void);
+void *mem_map(size_t size);
+void *mem_map_aligned(size_t size, size_t align, size_t offset);
+void mem_unmap(void *p);
+void *mem_remap(void *p, size_t size);
+void mem_decommit(void *p, size_t size);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
 size_t mem_pagesize(void);
+int mem_numa_nodes(void);
+int mem_numa_node(void);
+int mem_node_of(const void *p);
+int mem_bind(void *p, size_t size, int node);
+int mem_region_bind(int region, int node);
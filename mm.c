@@ -1,26 +1,86 @@
 /* 
- * Simple, 32-bit and 64-bit clean allocator based on an implicit free list,
- * first fit placement, and boundary tag coalescing, as described in the
- * CS:APP3e text.  Blocks are aligned to double-word boundaries.  This
+ * Simple, 32-bit and 64-bit clean allocator based on segregated explicit
+ * free lists and boundary tag coalescing, as described in the CS:APP3e
+ * text.  The free lists form a two-level segregated-fit index in the
+ * style of TLSF: a first level of power-of-two classes, each split into
+ * SL_COUNT linear subclasses, with bitmaps at both levels so that a
+ * good fit is found in constant time.  Unless the placement policy is
+ * LIFO first fit, free blocks of at least TREE_MIN bytes are instead kept
+ * in a treap ordered by size and address, which yields the best fit in
+ * logarithmic time.  Blocks are aligned to double-word boundaries.  This
  * yields 8-byte aligned blocks on a 32-bit processor, and 16-byte aligned
  * blocks on a 64-bit processor.  However, 16-byte alignment is stricter
- * than necessary; the assignment only requires 8-byte alignment.  The
+ * than necessary; the assignment only requires 8-byte alignment.  Only
+ * free blocks carry a footer; a bit in each header records whether the
+ * previous block is allocated, so an allocated block costs one word.  The
  * minimum block size is four words.
  *
+ * Requests of at most MM_SLAB_MAX bytes bypass the boundary-tag heap and
+ * are served from slabs: page-sized runs of equal, header-less slots
+ * tracked by a bitmap.  A slab mostly empty costs more than the headers it
+ * saves, so each class stays in the heap until some thread holds a slab's
+ * worth of live blocks of it.  Slabs live in their own memlib regions, so
+ * the address of a pointer alone tells mm_free which kind of memory it is.
+ * Likewise, requests above a threshold get a mapping of their own outside
+ * every region, which is returned to the OS as soon as it is freed.
+ * mm_calloc clears only what may be dirty: a new mapping is zero, and so is
+ * most of the free block that ends a heap, which grows into memory that
+ * memlib has never handed out.
+ *
+ * On a NUMA machine the arenas are divided among the nodes, and each
+ * arena's regions are bound to its node.  A thread allocates from an
+ * arena of the node it first runs on, and mm_malloc_node allocates on an
+ * explicit node.
+ *
+ * An optional heap profiler samples about one allocation per
+ * MM_OPT_PROF_RATE bytes and keeps the sampled blocks' call stacks, in
+ * mmprof.c, until they are freed.
+ *
  * This allocator uses the size of a pointer, e.g., sizeof(void *), to
  * define the size of a word.  This allocator also uses the standard
  * type uintptr_t to define unsigned integers that are the same size
  * as a pointer, i.e., sizeof(uintptr_t) == sizeof(void *).
  */
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "mmprof.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Thread-safe mode.  When MM_THREADS is nonzero, each arena is protected
+ * by its own lock and every thread keeps a private cache of recently freed
+ * small blocks in front of the arenas; see the tcache routines.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 1
+#endif
+
+#if MM_THREADS
+#include <pthread.h>
+#endif
+
+/*
+ * Guard mode.  When MM_GUARD is nonzero, every block ends with a canary
+ * word, which mm_free checks to catch overruns and double frees close to
+ * where they happen, and mm_free poisons the start of each freed payload.
+ * The checks touch a bounded number of words per call, whatever the size
+ * of the block, so a guard build can run on real workloads.
+ */
+#ifndef MM_GUARD
+#define MM_GUARD 0
+#endif
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -42,14 +102,52 @@ team_t team = {
 /* Basic constants and macros: */
 #define WSIZE      sizeof(void *) /* Word and header/footer size (bytes) */
 #define DSIZE      (2 * WSIZE)    /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1 << 12)      /* Extend heap by this amount (bytes) */
-#define BUCKET(p)  (unsigned int) (pow(2, p + 4))
+#define CHUNKSIZE  (1 << 12)      /* Default smallest heap extension (bytes) */
+#define GROW_SHIFT 3              /* Extend the heap by 1/8 of its size */
+#define NARENAS    (MEM_REGIONS / 2) /* Arenas: a heap and a slab region each */
+
+/* Two-level segregated free list index: */
+#define FL_COUNT     20                  /* First-level classes (to 64 MiB) */
+#define SL_LOG2      3                   /* log2 of SL_COUNT */
+#define SL_COUNT     (1 << SL_LOG2)      /* Linear subclasses per class */
+#define NLISTS       (FL_COUNT * SL_COUNT) /* Number of free lists */
+#define ALIGN_LOG2   (WSIZE == 8 ? 4 : 3)  /* log2 of DSIZE */
+#define SMALL_BLOCK  (1 << (SL_LOG2 + ALIGN_LOG2)) /* Sizes below are exact */
+
+/* Per-thread cache parameters: */
+#define TCACHE_MAX    1024  /* Largest block size (bytes) that is cached */
+#define TCACHE_BINS   (6 * SL_COUNT) /* Covers find_list(TCACHE_MAX) */
+#define TCACHE_COUNT  8     /* Maximum number of blocks cached per list */
+#define TCACHE_FILL   4     /* Blocks prefetched on a contended miss */
+#define TCACHE_NBINS  (TCACHE_BINS + SLAB_CLASSES) /* Block and slot bins */
+
+/* Bytes between checks for the profiler being switched on: */
+#define PROF_RECHECK  (1 << 20)
+
+/* Smallest free block kept in the size tree, by all but MM_POLICY_LIFO: */
+#define TREE_MIN      (1 << 10)
+
+/* Slab parameters: */
+#ifndef MM_SLAB_MAX
+#define MM_SLAB_MAX   256   /* Largest request served by a slab; 0 is off */
+#endif
+#define SLAB_SIZE     4096  /* Bytes per slab, a power of two */
+#define SLAB_CLASSES  ((int)(MM_SLAB_MAX / DSIZE)) /* One per DSIZE multiple */
+#define SLAB_MAPWORDS ((int)(SLAB_SIZE / DSIZE / 64)) /* Bitmap words per slab */
+#define GUARD_SIZE    (MM_GUARD ? WSIZE : 0) /* Canary bytes per block */
+#define GUARD_POISON  64    /* Most bytes of a freed payload poisoned */
+#define GUARD_BYTE    0x5a  /* Poison pattern */
+#define ZERO_STREAM   (1 << 18) /* Clear larger runs past the caches */
 
 #define MAX(x, y)  ((x) > (y) ? (x) : (y))  
+#define MIN(x, y)  ((x) < (y) ? (x) : (y))
 
 /* Pack a size and allocated bit into a word. */
 #define PACK(size, alloc)  ((size) | (alloc))
 
+/* Header bit 1 is set iff the previous block is allocated. */
+#define PREV_ALLOC  0x2
+
 /* Read and write a word at address p. */
 #define GET(p)       (*(uintptr_t *)(p))
 #define PUT(p, val)  (*(uintptr_t *)(p) = (val))
@@ -57,12 +155,42 @@ team_t team = {
 /* Read the size and allocated fields from address p. */
 #define GET_SIZE(p)   (GET(p) & ~(DSIZE - 1))
 #define GET_ALLOC(p)  (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)  (GET(p) & PREV_ALLOC)
+
+/* Set or clear the previous-block-allocated bit of the header at p. */
+#define SET_PREV_ALLOC(p)  PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p)  PUT(p, GET(p) & ~PREV_ALLOC)
+
+/*
+ * Decide whether a request goes to a slab, round it up to its slot size,
+ * and map that to its class.
+ */
+#define SLAB_FITS(size)   ((size) + GUARD_SIZE <= MM_SLAB_MAX)
+#define SLOT_SIZE(size)   (((size) + GUARD_SIZE + (DSIZE - 1)) & ~(DSIZE - 1))
+#define SLAB_CLASS(size)  ((int)(((size) - 1) >> ALIGN_LOG2))
 
-/* Given block ptr bp, compute address of its header and footer. */
+/*
+ * Map the size of a heap block that a request of a closed slab class got
+ * to the counter of its live blocks.
+ */
+#define SLAB_HEAP_MAX     ASIZE(MM_SLAB_MAX)
+#define SLAB_LIVE(bsize)  ((int)((bsize) / DSIZE))
+
+/* Adjust a request size to include the header, canary and alignment reqs. */
+#define ASIZE(size)  ((size) + GUARD_SIZE <= DSIZE + WSIZE ? 2 * DSIZE : \
+	DSIZE * (((size) + WSIZE + GUARD_SIZE + (DSIZE - 1)) / DSIZE))
+
+/* The canary of a live block; a freed block's is its complement. */
+#define CANARY(bp)  ((uintptr_t)(bp) ^ (uintptr_t)0x5ca1ab1e0ddba11ULL)
+
+/* Given block ptr bp, compute address of its header and (free) footer. */
 #define HDRP(bp)  ((char *)(bp) - WSIZE)
 #define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks. */
+/*
+ * Given block ptr bp, compute address of next and previous blocks.  The
+ * previous block can only be found when it is free.
+ */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
@@ -83,21 +211,269 @@ struct free_block {
 	struct free_block *next; 
 };
 
+/*
+ * A tree block:
+ *
+ *  A free block of at least TREE_MIN bytes in an arena's size tree, a
+ *  treap whose nodes are ordered by size, then address, and whose heap
+ *  priority is a hash of each node's address.  It overlays the links of
+ *  a free list block.
+ */
+struct tree_block {
+	struct tree_block *left;  /* Subtree of smaller nodes */
+	struct tree_block *right; /* Subtree of larger nodes */
+};
+
+/* Order and prioritize the nodes of a size tree. */
+#define TREE_LESS(a, b)  (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) ||       \
+	(GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+#define TREE_PRIO(bp)  ((uintptr_t)(bp) * (uintptr_t)0x9e3779b97f4a7c15ULL)
+
+/*
+ * A slab:
+ *
+ *  The header at the start of a SLAB_SIZE-aligned page that is divided
+ *  into "nslots" slots of "size" bytes.  Bit i of "map" is set iff slot i
+ *  is allocated; the bits past the last slot are always set.
+ */
+struct slab {
+	struct slab *prev;    /* Links in the arena's partial or empty list */
+	struct slab *next;
+	unsigned int size;    /* Slot size in bytes */
+	unsigned int nslots;  /* Number of slots */
+	unsigned int nfree;   /* Number of free slots */
+	unsigned int first;   /* Offset of slot 0 from the slab (bytes) */
+	uint64_t map[SLAB_MAPWORDS];
+};
+
+/*
+ * A thread's counters for mm_getstats:
+ *
+ *  Written only by their own thread, without atomic read-modify-writes,
+ *  and read by any.  "in_use" may wrap, since threads free each other's
+ *  blocks, but the sum over all threads is exact.
+ */
+struct tstats {
+	unsigned long nmalloc;  /* Blocks allocated */
+	unsigned long nfree;    /* Blocks freed */
+	unsigned long nrealloc; /* Calls of mm_realloc */
+	unsigned long nrealloc_inplace; /* Of those, ones that kept the block */
+	size_t in_use;          /* Bytes allocated less bytes freed */
+};
+
+/* Add "n" to the calling thread's counter "field". */
+#define STAT_ADD(field, n)  \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+/*
+ * A per-thread cache:
+ *
+ *  Holds recently freed blocks of at most TCACHE_MAX bytes, one singly
+ *  linked bin per segregated list, followed by one bin per slab class.
+ *  Cached blocks and slots stay marked allocated, so they are never
+ *  coalesced or reused by another thread while they sit in a bin.
+ */
+struct tcache {
+	struct free_block *bins[TCACHE_NBINS]; /* Linked through "next" */
+	unsigned int counts[TCACHE_NBINS];     /* Number of blocks per bin */
+	unsigned int epoch;              /* Value of heap_epoch when valid */
+	struct arena *arena;             /* Arena this thread allocates from */
+	struct tstats stats;             /* Counters since the last mm_init */
+	ptrdiff_t prof_left;             /* Bytes to go before the next sample */
+	uint64_t prof_seed;              /* Random state, or 0 if unseeded */
+	int slab_live[SLAB_LIVE(SLAB_HEAP_MAX) + 1]; /* Small heap blocks held */
+
+	/* The fields below survive the reset at the start of an epoch. */
+	struct tcache *link;             /* Next cache of a live thread */
+	bool listed;                     /* Set iff linked into "tcaches" */
+};
+
+/*
+ * An arena:
+ *
+ *  An independent heap with its own prologue, free list array and
+ *  epilogue, laid out in memlib region "region".  Every block lives in
+ *  exactly one arena, which is found from the block's address.  Threads
+ *  of other arenas return blocks without the lock, by pushing them onto
+ *  the arena's remote stack, which its own threads drain on a miss.
+ */
+struct arena {
+	struct free_block **free_listp; /* Pointer to free list array */ 
+	char *heap_listp; /* First block after free list array, or NULL */ 
+	unsigned int fl_bitmap; /* Bit i is set iff class i has a free block */
+	unsigned char sl_bitmap[FL_COUNT]; /* Same, for each subclass */
+	struct tree_block *tree; /* Root of the size tree */
+	struct free_block *quick[NLISTS]; /* Deferred frees, by free list */
+	unsigned int nquick; /* Number of deferred frees */
+	int policy;        /* Placement policy, fixed when laid out */
+	struct slab *partial[SLAB_CLASSES + 1]; /* Slabs with a free slot */
+	struct slab *empty; /* Unused slabs, ready for any class */
+	bool slab_open[SLAB_CLASSES + 1]; /* Set iff the class uses slabs */
+	int region;        /* memlib region that holds this heap */
+	int node;          /* NUMA node that the arena's memory is bound to */
+	char *clean;       /* The free block ending the heap is zero from here */
+#if MM_THREADS
+	pthread_mutex_t lock; /* Protects every field and block above */
+#endif
+	struct free_block *remote; /* Frees from other arenas' threads */
+
+	/* Counters for mm_getstats, under the lock: */
+	size_t free_bytes[NLISTS]; /* Bytes of free blocks, by free list */
+	unsigned long nextend; /* Heap extensions */
+	unsigned long nfit;    /* Calls of find_fit */
+	unsigned long nprobe;  /* Free blocks that find_fit examined */
+};
+
 /* Global variables: */
-static struct free_block **free_listp; /* Pointer to free list array */ 
-static char *heap_listp; /* Pointer to first block after free list array */ 
-static size_t failedsize; /* Last size that needed heap extension */ 
+static struct arena arenas[NARENAS];
+static unsigned int next_arena[NARENAS]; /* Round-robin counter per node */
+static int nnodes = 1;          /* NUMA nodes that the arenas divide into */
+static unsigned int heap_epoch; /* Bumped by mm_init to void all tcaches */
+static struct tcache *tcaches;  /* Caches of live threads, for mm_getstats */
+static struct tstats retired;   /* Counters of threads that have exited */
+
+/* Tunables, set by mm_setopt: */
+static size_t grow_min = CHUNKSIZE;     /* Smallest heap extension */
+static size_t grow_max = 256 * CHUNKSIZE; /* Largest geometric extension */
+static size_t mmap_threshold = 32 * CHUNKSIZE; /* Larger requests are mapped */
+static size_t trim_threshold = 512 * CHUNKSIZE; /* Larger free blocks are released */
+static int policy = MM_POLICY_LIFO;    /* Placement policy for new arenas */
+static int best_fit_scan = 8;          /* Candidates seen by best fit */
+static unsigned int defer_max;         /* Deferred frees; 0 coalesces at once */
+static size_t prof_rate;               /* Mean bytes per sample; 0 is off */
+
+#if MM_THREADS
+static pthread_key_t tcache_key; /* Flushes a thread's tcache at exit */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static __thread struct tcache tcache;
+
+static pthread_mutex_t tcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOCK(ar)     pthread_mutex_lock(&(ar)->lock)
+#define TRYLOCK(ar)  (pthread_mutex_trylock(&(ar)->lock) == 0)
+#define UNLOCK(ar)   pthread_mutex_unlock(&(ar)->lock)
+#define LOCK_TCACHES()    pthread_mutex_lock(&tcaches_lock)
+#define UNLOCK_TCACHES()  pthread_mutex_unlock(&tcaches_lock)
+#else
+static struct tcache tcache;
+
+#define LOCK(ar)     ((void)(ar))
+#define TRYLOCK(ar)  ((void)(ar), true)
+#define UNLOCK(ar)   ((void)(ar))
+#define LOCK_TCACHES()    ((void)0)
+#define UNLOCK_TCACHES()  ((void)0)
+#endif
+
+#if MM_STATS_LISTS != NLISTS
+#error "MM_STATS_LISTS in mm.h must equal NLISTS"
+#endif
+
+/* Find the floor of the base 2 logarithm of a nonzero size. */
+#define FLOOR_LOG2(size)  \
+	((int)(8 * sizeof(unsigned long)) - 1 - __builtin_clzl(size))
+
+/*
+ * Given block ptr bp, find the arena that owns it, whether bp is in a
+ * slab, and if so which slab.  Arena i's slabs are in region NARENAS + i.
+ */
+#define ARENA_OF(bp)  (&arenas[mem_region_of(bp) % NARENAS])
+#define IS_SLAB(bp)   (mem_region_of(bp) >= NARENAS)
+#define IS_MAPPED(bp) (mem_region_of(bp) < 0)
+#define MAP_START(bp) ((char *)GET((char *)(bp) - DSIZE))
+#define SLAB_OF(bp)   ((struct slab *)((uintptr_t)(bp) & ~(uintptr_t)(SLAB_SIZE - 1)))
 
 /* Function prototypes for internal helper routines: */
-static void *coalesce(void *bp);
-static void *extend_heap(size_t words); 
-static void *find_fit(size_t asize);
-static void place(void *bp, size_t asize, bool remove_flag);
+static int arena_init(struct arena *ar);
+static void *coalesce(struct arena *ar, void *bp);
+static void *extend_heap(struct arena *ar, size_t words); 
+static size_t grow_size(struct arena *ar, size_t need);
+static void *find_fit(struct arena *ar, size_t asize);
+static void *heap_fit(struct arena *ar, size_t asize);
+static void *heap_malloc(struct arena *ar, size_t asize);
+static void *heap_zalloc(struct arena *ar, size_t asize, size_t size,
+    size_t *dirty);
+static size_t heap_carve(struct arena *ar, void *bp, size_t asize,
+    size_t n, void **out);
+static void *heap_memalign(struct arena *ar, size_t align, size_t asize);
+static void heap_free(struct arena *ar, void *bp);
+static void heap_release(struct arena *ar, void *bp);
+static void *quick_get(struct arena *ar, size_t asize);
+static void consolidate(struct arena *ar);
+static bool heap_trim(struct arena *ar, size_t pad);
+static void decommit_free(void *bp);
+static void *heap_realloc(struct arena *ar, void *bp, size_t asize);
+static void shrink_block(struct arena *ar, void *bp, size_t asize);
+static void place(struct arena *ar, void *bp, size_t asize,
+    bool remove_flag);
+
+/* Function prototypes for the size tree routines: */
+static void tree_insert(struct tree_block **linkp, struct tree_block *node);
+static void tree_remove(struct tree_block **linkp, struct tree_block *node);
+static void *tree_find(struct arena *ar, size_t asize);
+static void tree_decommit(struct tree_block *t);
+
+/* Function prototypes for the slab routines: */
+static bool slab_use(struct arena *ar, struct tcache *tc, size_t size);
+static void slab_held(struct tcache *tc, size_t bsize, int n);
+static void *slab_alloc(struct arena *ar, size_t ssize, bool grow);
+static void slab_free(struct arena *ar, void *bp);
+static void slab_unlink(struct slab **listp, struct slab *slab);
+static void slab_push(struct slab **listp, struct slab *slab);
+
+/* Function prototypes for the mapped block routines: */
+static void *map_alloc(size_t size, size_t align);
+static void *map_realloc(void *bp, size_t size);
+static void *map_block(char *p, size_t msize, size_t lead);
+static size_t map_size(size_t size);
+
+/* Function prototypes for the batch and calloc routines: */
+static int ptr_compare(const void *a, const void *b);
+static void zero_fill(void *p, size_t n);
+
+/* Function prototypes for the per-thread cache routines: */
+static struct tcache *tcache_self(void);
+static struct arena *node_arena(int node, unsigned int n);
+static void *tcache_get(int idx, size_t asize);
+static void tcache_put(void *bp, int idx);
+static void tcache_fill(struct arena *ar, int idx, size_t asize);
+static void tcache_flush(struct tcache *tc, int idx, unsigned int count);
+
+/* Function prototypes for the statistics routines: */
+static void *count_alloc(void *bp, size_t bsize);
+static void prof_tick(struct tcache *tc, void *bp, size_t bsize);
+static void count_free(unsigned long n, size_t bytes);
+static size_t block_size(void *bp);
+static void stats_add(struct tstats *sum, const struct tstats *st);
+
+/* Function prototypes for the remote free routines: */
+static void remote_push(struct arena *ar, void *bp);
+static bool remote_drain(struct arena *ar);
+#if MM_THREADS
+static void mm_once(void);
+static void tcache_release(void *arg);
+#endif
+
+/* Function prototypes for the guard mode routines: */
+#if MM_GUARD
+static uintptr_t *guard_word(void *bp);
+static void guard_arm(void *bp);
+static void guard_check(void *bp, bool freeing);
+static void guard_fail(void *bp, const char *what);
+#else
+#define guard_arm(bp)              ((void)0)
+#define guard_check(bp, freeing)   ((void)0)
+#endif
 
 /* Function prototypes for heap consistency checker routines: */
-static void checkblock(void *bp);
-static void checkheap(bool verbose);
-static void printblock(void *bp); 
+static int checkblock(void *bp);
+static int checkarena(struct arena *ar, int level);
+static int checklists(struct arena *ar, unsigned long nfree);
+static int checkfree(struct arena *ar, void *bp, int list);
+static int checktree(struct arena *ar, struct tree_block *t,
+    struct tree_block *lo, struct tree_block *hi, unsigned long *count);
+static int checkslabs(struct arena *ar, int level);
+static int checkclean(struct arena *ar, char *bp);
+static void printblock(void *bp);
 
 /*
  * The following are team defined helper functions.
@@ -115,25 +491,22 @@ static void printblock(void *bp);
 int
 find_list(size_t size)
 {	
+	int fl, sl, f;
 
-	if (size <= 64) {
-		return 0;
-	} else if (size <= 128) {
-		return 1;
-	} else if (size <= 256) {
-		return 2;
-	} else if (size <= 512) {
-		return 3;
-	} else if (size <= 1024) {
-		return 4;
-	} else if (size <= 2048) {
-		return 5;
-	} else if (size <= 4096) {
-		return 6;
-	} else {
-		return 7;
-	}   
-};
+	/*
+	 *  Sizes below SMALL_BLOCK get one list per multiple of DSIZE in
+	 *  class 0.  Above that, class fl covers one power of two, found with
+	 *  clz, and the SL_LOG2 bits below the leading one pick the subclass.
+	 */
+	if (size < SMALL_BLOCK)
+		return ((int)(size >> ALIGN_LOG2));
+	f = FLOOR_LOG2(size);
+	fl = f - (SL_LOG2 + ALIGN_LOG2) + 1;
+	sl = (int)(size >> (f - SL_LOG2)) - SL_COUNT;
+	if (fl >= FL_COUNT)
+		return (NLISTS - 1);
+	return (fl * SL_COUNT + sl);
+}
 
 /*
  * Requires:
@@ -141,14 +514,43 @@ find_list(size_t size)
  *
  * Effects:
  *   Inserts the block pointed to by bp into the front of
- *    the appropriate free linked list for a block of this size.  
- *    
+ *    the appropriate free linked list for a block of this size, or
+ *    in address order, or into the size tree, as the arena's placement
+ *    policy requires.
  */
 void
-insert_free(size_t asize, void *bp) 
+insert_free(struct arena *ar, size_t asize, void *bp) 
 {
+        struct free_block **free_listp = ar->free_listp;
         struct free_block *first;
-        int idx = find_list(asize); 
+        struct free_block *prev;
+        int idx; 
+
+	ar->free_bytes[find_list(asize)] += asize;
+	if (ar->policy != MM_POLICY_LIFO && asize >= TREE_MIN) {
+		tree_insert(&ar->tree, (struct tree_block *)bp);
+		return;
+	}
+	idx = find_list(asize);
+
+	/*
+	 *  Keep an address-ordered list sorted: a block that does not go
+	 *  first is linked in after the last block below it.
+	 */
+	if (ar->policy == MM_POLICY_ADDRESS && free_listp[idx] != NULL &&
+	    (char *)free_listp[idx] < (char *)bp) {
+		first = (struct free_block *)bp;
+		for (prev = free_listp[idx]; prev->next != NULL &&
+		    (char *)prev->next < (char *)bp; prev = prev->next)
+			continue;
+		first->next = prev->next;
+		first->prev = prev;
+		if (prev->next != NULL)
+			prev->next->prev = first;
+		prev->next = first;
+		return;
+	}
+
 	/* 
 	 *  If the explicit free list is empty, set the block 
 	 *  as the one node of the list. Else, insert block at start 
@@ -156,6 +558,8 @@ insert_free(size_t asize, void *bp)
 	 *  rest of the list. 
 	 */
     if (free_listp[idx] == NULL) {
+	        ar->sl_bitmap[idx >> SL_LOG2] |= 1u << (idx & (SL_COUNT - 1));
+	        ar->fl_bitmap |= 1u << (idx >> SL_LOG2);
 	        free_listp[idx] = (struct free_block *) bp;
 			free_listp[idx]->next = NULL;
 	        free_listp[idx]->prev = NULL;
@@ -180,13 +584,20 @@ insert_free(size_t asize, void *bp)
  */
 
 void
-remove_free(void *bp) 
+remove_free(struct arena *ar, void *bp) 
 {
 
+	struct free_block **free_listp = ar->free_listp;
 	size_t size = GET_SIZE(HDRP(bp));
 	int list = find_list(size);
 	struct free_block *current = (struct free_block *) bp;
 
+	ar->free_bytes[list] -= size;
+	if (ar->policy != MM_POLICY_LIFO && size >= TREE_MIN) {
+		tree_remove(&ar->tree, (struct tree_block *)bp);
+		return;
+	}
+
 	/* 
 	 *  If the block is at the start of the list, either make the 
 	 *  next block the first node of the list, or if it was the only 
@@ -199,6 +610,10 @@ remove_free(void *bp)
 			return;
 		} else {
 			free_listp[list] = NULL;
+			ar->sl_bitmap[list >> SL_LOG2] &=
+			    ~(1u << (list & (SL_COUNT - 1)));
+			if (ar->sl_bitmap[list >> SL_LOG2] == 0)
+				ar->fl_bitmap &= ~(1u << (list >> SL_LOG2));
 			return;
 		}
 	}
@@ -232,31 +647,37 @@ int
 mm_init(void) 
 {
 
-	void *startp;
 	int i; 
 
-	if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void *)-1)
-		return (-1);
-	PUT(heap_listp, 0);                            /* Alignment padding */
-	PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
-	PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
-	PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     /* Epilogue header */
-	heap_listp += (2 * WSIZE);
+#if MM_THREADS
+	pthread_once(&init_once, mm_once);
+#endif
 
-	if ((startp = mem_sbrk(10 * sizeof(struct free_block *) )) == (void *)-1)
+	/*
+	 * Deal the arenas out to the NUMA nodes.  Only arena 0 is laid out
+	 * now; the others wait for a thread.
+	 */
+	nnodes = MIN(mem_numa_nodes(), NARENAS);
+	for (i = 0; i < NARENAS; i++) {
+		arenas[i].heap_listp = NULL;
+		arenas[i].region = i;
+		arenas[i].node = i % nnodes;
+		arenas[i].remote = NULL;
+		memset(arenas[i].free_bytes, 0, sizeof(arenas[i].free_bytes));
+		arenas[i].nextend = arenas[i].nfit = arenas[i].nprobe = 0;
+		mem_region_bind(i, arenas[i].node);
+		mem_region_bind(NARENAS + i, arenas[i].node);
+		next_arena[i] = 0;
+	}
+	if (arena_init(&arenas[0]) == -1)
 		return (-1);
-	
-	// Set the header and footer, as well an extended epilogue header. 
-	PUT(HDRP(startp), PACK(10 * WSIZE , 1));
-	PUT(FTRP(startp), PACK(10 * WSIZE , 1));
-	PUT(NEXT_BLKP(startp), PACK(0, 1));     /* Epilogue header */
 
-	// Initialize all free lists to null. 
-	struct free_block *first_list = (struct free_block *) startp;
-	free_listp = (struct free_block **) first_list;
-	for (i = 0; i < 8; i++) {
-		free_listp[i] = NULL;
-	}
+	/* Blocks cached by any thread belong to the old heap: drop them. */
+	LOCK_TCACHES();
+	memset(&retired, 0, sizeof(retired));
+	heap_epoch++;
+	UNLOCK_TCACHES();
+	prof_reset();
 	return (0);
 }
 
@@ -273,48 +694,118 @@ void *
 mm_malloc(size_t size) 
 {
 
+	struct tcache *tc;
+	struct arena *ar;
 	size_t asize;      /* Adjusted block size */
-	size_t extendsize; /* Amount to extend heap if no fit */
 	void *bp;
+	bool slab;
+	bool contended;
+	int idx = -1;      /* tcache bin, if any */
 
 	/* Ignore spurious requests. */
 	if (size == 0)
 		return (NULL);
 
+	/* Keep large blocks out of the heap, so that they never fragment it. */
+	if (size > mmap_threshold) {
+		bp = map_alloc(size, DSIZE);
+		return (count_alloc(bp, block_size(bp)));
+	}
+
 	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
-		asize = 2 * DSIZE;
-	else
-		asize = DSIZE * ((size + DSIZE + (DSIZE - 1)) / DSIZE);
+	tc = tcache_self();
+	if ((slab = SLAB_FITS(size) && slab_use(tc->arena, tc, size))) {
+		asize = SLOT_SIZE(size);
+		idx = TCACHE_BINS + SLAB_CLASS(asize);
+	} else {
+		asize = ASIZE(size);
+		if (asize <= TCACHE_MAX)
+			idx = find_list(asize);
+	}
+
+	/* Most small requests are served by this thread's cache, unlocked. */
+	if (idx >= 0 && (bp = tcache_get(idx, asize)) != NULL) {
+		if (!slab)
+			slab_held(tc, GET_SIZE(HDRP(bp)), 1);
+		return (count_alloc(bp, slab ? asize : GET_SIZE(HDRP(bp))));
+	}
+
+	ar = tc->arena;
+	if ((contended = !TRYLOCK(ar)))
+		LOCK(ar);
+
+	/* Lay out the arena's heap when its first thread shows up. */
+	if (ar->heap_listp == NULL && arena_init(ar) == -1) {
+		UNLOCK(ar);
+		return (NULL);
+	}
+	bp = slab ? slab_alloc(ar, asize, true) : heap_malloc(ar, asize);
 
 	/*
- 	*  Optimization trick. If the last malloc request found no fit and 
-	*  this current one asks for the same size, just skip to extending the
-	*  heap - there is still no free block large enough for it. 
- 	*/
-	if (asize == failedsize) {
-		if ((bp = extend_heap(asize / WSIZE)) == NULL) {
-			return (NULL);
-		}
-		place(bp, asize, 0);
-		return (bp);
+	 * If another thread holds the arena, this thread is likely to miss
+	 * again soon, so prefetch a few more blocks while we have the lock.
+	 */
+	if (bp != NULL && contended && idx >= 0)
+		tcache_fill(ar, idx, asize);
+	UNLOCK(ar);
+	if (bp == NULL)
+		return (NULL);
+	if (!slab)
+		slab_held(tc, GET_SIZE(HDRP(bp)), 1);
+	return (count_alloc(bp, slab ? asize : GET_SIZE(HDRP(bp))));
+} 
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate a block with at least "nmemb" * "size" bytes of payload, all
+ *   of them zero, unless that product is zero or overflows.  Returns the
+ *   address of this block if the allocation was successful and NULL
+ *   otherwise.  Only bytes that may be nonzero are cleared: a mapped block
+ *   is new, and a heap block is mostly new if heap_zalloc says so.
+ */
+void *
+mm_calloc(size_t nmemb, size_t size)
+{
+	struct arena *ar;
+	size_t asize, dirty;
+	void *bp;
+
+	if (nmemb != 0 && size > SIZE_MAX / nmemb)
+		return (NULL);
+	size *= nmemb;
+	if (size == 0)
+		return (NULL);
+
+	/* A new mapping is zero-filled. */
+	if (size > mmap_threshold) {
+		bp = map_alloc(size, DSIZE);
+		return (count_alloc(bp, block_size(bp)));
 	}
 
-	/* Search the free lists for a fit and place into the free block. */
-	if ((bp = find_fit(asize)) != NULL) {
-		place(bp, asize, 1);
+	/* Small blocks are mostly reused ones, and cheap to clear. */
+	asize = ASIZE(size);
+	if (SLAB_FITS(size) || asize <= TCACHE_MAX) {
+		if ((bp = mm_malloc(size)) != NULL)
+			zero_fill(bp, size);
 		return (bp);
 	}
 
-	/* No fit found.  Get more memory and place the block. */
-	extendsize = asize;
-	failedsize = asize;
-	if ((bp = extend_heap(extendsize / WSIZE)) == NULL) {
+	ar = tcache_self()->arena;
+	LOCK(ar);
+	if (ar->heap_listp == NULL && arena_init(ar) == -1) {
+		UNLOCK(ar);
 		return (NULL);
 	}
-	place(bp, asize, 0);
-	return (bp);
-} 
+	bp = heap_zalloc(ar, asize, size, &dirty);
+	UNLOCK(ar);
+	if (bp == NULL)
+		return (NULL);
+	zero_fill(bp, dirty);
+	return (count_alloc(bp, GET_SIZE(HDRP(bp))));
+}
 
 /* 
  * Requires:
@@ -326,27 +817,43 @@ mm_malloc(size_t size)
 void
 mm_free(void *bp)
 {
+	struct arena *ar;
 	size_t size;
 
 	/* Ignore spurious requests. */
 	if (bp == NULL)
 		return;
 
+	guard_check(bp, true);
+	if (PROF_MAYBE_SAMPLED(bp))
+		prof_free(bp);
+	if (IS_MAPPED(bp)) {
+		count_free(1, GET_SIZE(HDRP(bp)));
+		mem_unmap(MAP_START(bp));
+		return;
+	}
+	if (IS_SLAB(bp)) {
+		count_free(1, SLAB_OF(bp)->size);
+		tcache_put(bp, TCACHE_BINS + SLAB_CLASS(SLAB_OF(bp)->size));
+		return;
+	}
 	size = GET_SIZE(HDRP(bp));
-	
-	/* For optimization. If we have a new freed chunk equal to the size
-	* of the last size that required extension, we no longer need 
-	* auto-extension in malloc. 
-	*/ 
-	if (size == failedsize) {
-		failedsize = 0;
+	count_free(1, size);
+	slab_held(tcache_self(), size, -1);
+	if (size <= TCACHE_MAX) {
+		tcache_put(bp, find_list(size));
+		return;
 	}
 
-	// Set the allocation flags of the block to free! 
-	// Coalesce the newly freed block. 
-    PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
-	coalesce(bp); 
+	/* Return the block to whichever arena owns it. */
+	ar = ARENA_OF(bp);
+	if (ar != tcache_self()->arena) {
+		remote_push(ar, bp);
+		return;
+	}
+	LOCK(ar);
+	heap_free(ar, bp);
+	UNLOCK(ar);
 }
 
 /*
@@ -367,17 +874,16 @@ mm_free(void *bp)
 void *
 mm_realloc(void *ptr, size_t size)
 {	
-	size_t oldsize;
-	size_t asize;
-	void *newptr = NULL;
-	
-	oldsize = GET_SIZE(HDRP(ptr));
+	struct tstats *st = &tcache_self()->stats;
+	struct arena *ar;
+	size_t oldsize, bsize;
+	void *newptr;
 
-	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
-		asize = 2 * DSIZE;
-	else
-		asize = DSIZE * ((size + DSIZE + (DSIZE - 1)) / DSIZE);
+	STAT_ADD(st->nrealloc, 1);
+
+	/* If oldptr is NULL, then this is just malloc. */
+	if (ptr == NULL)
+		return (mm_malloc(size));
 
 	/* If size == 0 then this is just free, and we return NULL. */
 	if (size == 0) {
@@ -385,228 +891,2565 @@ mm_realloc(void *ptr, size_t size)
 		return (NULL);
 	}
 
-	/* If oldptr is NULL, then this is just malloc. */
-	if (ptr == NULL) {
-		return (mm_malloc(size));
-	// If not, we're going to (maybe) look for a new home for our block. 
-	} else { 
-		// If we are looking for a smaller size, return same block.
-		if (asize <= oldsize) {
-			// Made payload smaller, take internal fragmentation
-			return ptr;
-		// If we are looking for a larger block, extend heap or relocate.
-		} else if (GET_SIZE(HDRP(NEXT_BLKP(ptr))) == 0) {
-
-					extend_heap((asize - oldsize) / WSIZE);
-					PUT(HDRP(ptr), PACK(asize, 1));
-					PUT(FTRP(ptr), PACK(asize, 1));
-					return ptr;
-		} else {
-				newptr = mm_malloc(size);
-				memcpy(newptr, ptr, oldsize);
-				mm_free(ptr);
+	/*
+	 * A mapping that stays large is resized by the system.  A slot cannot
+	 * grow, so keep it only if the new size still fits.  A block that
+	 * is resized in place gets a new canary at its new end, and its
+	 * profile sample follows it.
+	 */
+	guard_check(ptr, false);
+	oldsize = mm_usable_size(ptr);
+	if (IS_MAPPED(ptr)) {
+		bsize = GET_SIZE(HDRP(ptr));
+		if (size > mmap_threshold) {
+			if ((newptr = map_realloc(ptr, size)) != NULL) {
+				guard_arm(newptr);
+				if (PROF_MAYBE_SAMPLED(ptr))
+					prof_realloc(ptr, newptr,
+					    GET_SIZE(HDRP(newptr)));
+				STAT_ADD(st->nrealloc_inplace, 1);
+				STAT_ADD(st->in_use, GET_SIZE(HDRP(newptr)) - bsize);
+			}
+			return (newptr);
+		}
+	} else if (IS_SLAB(ptr)) {
+		if (size <= oldsize) {
+			STAT_ADD(st->nrealloc_inplace, 1);
+			return (ptr);
+		}
+	} else {
+		// Try to resize in place first, staying in the owning arena,
+		// unless the block is to be mapped.
+		bsize = GET_SIZE(HDRP(ptr));
+		if (size <= mmap_threshold) {
+			ar = ARENA_OF(ptr);
+			LOCK(ar);
+			newptr = heap_realloc(ar, ptr, ASIZE(size));
+			UNLOCK(ar);
+			if (newptr != NULL) {
+				guard_arm(newptr);
+				if (PROF_MAYBE_SAMPLED(ptr))
+					prof_realloc(ptr, newptr,
+					    GET_SIZE(HDRP(newptr)));
+				slab_held(tcache_self(), bsize, -1);
+				slab_held(tcache_self(), GET_SIZE(HDRP(newptr)), 1);
+				STAT_ADD(st->nrealloc_inplace, 1);
+				STAT_ADD(st->in_use, GET_SIZE(HDRP(newptr)) - bsize);
 				return (newptr);
+			}
 		}
 	}
+
+	// Otherwise, look for a new home for our block.
+	if ((newptr = mm_malloc(size)) == NULL)
+		return (NULL);
+	memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+	mm_free(ptr);
+	return (newptr);
 }
 
 /*
- * The following routines are internal helper routines.
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Returns the number of bytes of payload in the block "ptr", which may
+ *   exceed the size that it was allocated with, or 0 if "ptr" is NULL.
  */
+size_t
+mm_usable_size(void *ptr)
+{
+
+	if (ptr == NULL)
+		return (0);
+	if (IS_MAPPED(ptr))
+		return (GET_SIZE(HDRP(ptr)) -
+		    (size_t)((char *)ptr - MAP_START(ptr)) - GUARD_SIZE);
+	if (IS_SLAB(ptr))
+		return (SLAB_OF(ptr)->size - GUARD_SIZE);
+	return (GET_SIZE(HDRP(ptr)) - WSIZE - GUARD_SIZE);
+}
 
 /*
  * Requires:
- *   "bp" is the address of a newly freed block.
+ *   None.
  *
  * Effects:
- *   Perform boundary tag coalescing.  Returns the address of the coalesced
- *   block.
+ *   Allocate a block with at least "size" bytes of payload whose address
+ *   is a multiple of "alignment", unless "size" is zero.  Returns the
+ *   address of this block if the allocation was successful and NULL
+ *   otherwise, including if "alignment" is not a power of two.
  */
-static void * 
-coalesce(void *bp) 
+void *
+mm_memalign(size_t alignment, size_t size)
 {
-	size_t size = GET_SIZE(HDRP(bp));
-	bool prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));  
-	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp))); 
-
-	if (prev_alloc && next_alloc) {                 /* Case 1 */
-	  	insert_free(size, bp);
-		return (bp);
-	} else if (prev_alloc && !next_alloc) {        /* Case 2 */  
-		remove_free(NEXT_BLKP(bp));
-
-		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-
-		PUT(HDRP(bp), PACK(size, 0));
-		PUT(FTRP(bp), PACK(size, 0));
-		
-		insert_free(size, bp);
-	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
-		remove_free(PREV_BLKP(bp));
+	struct arena *ar;
+	void *bp;
 
-		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return (NULL);
+	if (alignment <= DSIZE)
+		return (mm_malloc(size));
+	if (size == 0)
+		return (NULL);
 
-		PUT(FTRP(bp), PACK(size, 0));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
+	/* Alignments beyond a page would waste too much of the heap. */
+	if (size > mmap_threshold || alignment > mem_pagesize()) {
+		bp = map_alloc(size, alignment);
+		return (count_alloc(bp, block_size(bp)));
+	}
 
-		insert_free(size, bp);
+	ar = tcache_self()->arena;
+	LOCK(ar);
+	if (ar->heap_listp == NULL && arena_init(ar) == -1)
+		bp = NULL;
+	else
+		bp = heap_memalign(ar, alignment, ASIZE(size));
+	UNLOCK(ar);
+	return (count_alloc(bp, block_size(bp)));
+}
 
-	} else {                                        /* Case 4 */
-		remove_free(NEXT_BLKP(bp));
-		remove_free(PREV_BLKP(bp));
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   The C11 spelling of mm_memalign.
+ */
+void *
+mm_aligned_alloc(size_t alignment, size_t size)
+{
 
-		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-		
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-	
-		bp = PREV_BLKP(bp);
-		insert_free(size, bp);	
-	}
-	return (bp);	
+	return (mm_memalign(alignment, size));
 }
 
-/* 
+/*
  * Requires:
  *   None.
  *
  * Effects:
- *   Extend the heap with a free block and return that block's address.
+ *   Allocate a block with at least "size" bytes of payload, unless "size"
+ *   is zero, from memory on NUMA node "node".  Returns the address of this
+ *   block if the allocation was successful and NULL otherwise, including
+ *   if there is no such node.
  */
-static void *
-extend_heap(size_t words) 
+void *
+mm_malloc_node(size_t size, int node)
 {
-  
-	size_t size;
+	struct tcache *tc;
+	struct arena *ar;
 	void *bp;
+	bool slab;
 
-	/* Allocate an even number of words to maintain alignment. */
-	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-	if ((bp = mem_sbrk(size)) == (void *)-1)  
+	if (size == 0 || node < 0 || node >= mem_numa_nodes())
 		return (NULL);
+	if (size > mmap_threshold) {
+		if ((bp = map_alloc(size, DSIZE)) != NULL)
+			mem_bind(MAP_START(bp), GET_SIZE(HDRP(bp)), node);
+		return (count_alloc(bp, block_size(bp)));
+	}
 
-	/* Initialize free block header/footer and the epilogue header. */
- 	PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-	PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-
-	return bp;
+	/*
+	 * Bypass the cache, whose blocks may be from any node.  Of the node's
+	 * arenas, use the one in the position of this thread's own arena.
+	 */
+	tc = tcache_self();
+	ar = tc->arena;
+	if (ar->node != node % nnodes)
+		ar = node_arena(node % nnodes, (unsigned int)(ar - arenas));
+	slab = SLAB_FITS(size) && slab_use(ar, tc, size);
+	LOCK(ar);
+	if (ar->heap_listp == NULL && arena_init(ar) == -1)
+		bp = NULL;
+	else if (slab)
+		bp = slab_alloc(ar, SLOT_SIZE(size), true);
+	else
+		bp = heap_malloc(ar, ASIZE(size));
+	UNLOCK(ar);
+	if (bp != NULL && !slab)
+		slab_held(tc, GET_SIZE(HDRP(bp)), 1);
+	return (count_alloc(bp, block_size(bp)));
 }
 
 /*
  * Requires:
- *   "asize" is the aligned size malloc needs to find a free block for. 
+ *   "out" has room for "n" pointers.
  *
  * Effects:
- *   Find a fit for a block with "asize" bytes.  Returns that block's address
- *   or NULL if no suitable block was found. 
+ *   Allocates "n" blocks with at least "size" bytes of payload each and
+ *   stores their addresses in "out".  Blocks that come from the heap are
+ *   carved out of as few free blocks as possible, so they are mostly
+ *   adjacent.  Returns the number of blocks allocated, which is less than
+ *   "n" only if memory ran out; those blocks are at the start of "out".
  */
-static void *
-find_fit(size_t asize)
+size_t
+mm_malloc_batch(size_t size, size_t n, void **out)
 {
+	struct tcache *tc;
+	struct arena *ar;
+	size_t asize, i, done = 0;
+	void *bp;
+	bool slab;
 
-    struct free_block *current;
-	int idx = find_list(asize);
+	if (size == 0 || n == 0)
+		return (0);
 
-	/* Loop through the free lists to find a free list with an appropriate free block. */
-	while (idx < 8) {
-		for (current = free_listp[idx]; current !=  NULL; current = current->next) {
-			if (GET_SIZE(HDRP(current)) >= asize) 
-				return((void *)current);
+	/* Mapped blocks have nothing in common to amortize. */
+	if (size > mmap_threshold) {
+		for (; done < n; done++) {
+			if ((out[done] = map_alloc(size, DSIZE)) == NULL)
+				break;
+			count_alloc(out[done], block_size(out[done]));
 		}
-		idx++;     
+		return (done);
 	}
-	/* No fit was found. */
-	return (NULL);
+
+	tc = tcache_self();
+	ar = tc->arena;
+	slab = SLAB_FITS(size) && slab_use(ar, tc, size);
+	LOCK(ar);
+	if (ar->heap_listp == NULL && arena_init(ar) == -1) {
+		UNLOCK(ar);
+		return (0);
+	}
+	if (slab) {
+		asize = SLOT_SIZE(size);
+		for (; done < n; done++) {
+			if ((out[done] = slab_alloc(ar, asize, true)) == NULL)
+				break;
+		}
+	} else {
+		/* Look for one free block that holds the rest of the batch. */
+		asize = ASIZE(size);
+		while (done < n) {
+			if ((n - done) > SIZE_MAX / asize ||
+			    (bp = heap_fit(ar, (n - done) * asize)) == NULL)
+				bp = heap_fit(ar, asize);
+			if (bp == NULL)
+				break;
+			done += heap_carve(ar, bp, asize, n - done, out + done);
+		}
+	}
+	UNLOCK(ar);
+	for (i = 0; i < done; i++) {
+		if (slab)
+			count_alloc(out[i], asize);
+		else {
+			slab_held(tc, GET_SIZE(HDRP(out[i])), 1);
+			count_alloc(out[i], GET_SIZE(HDRP(out[i])));
+		}
+	}
+	return (done);
 }
 
-/* 
+/*
  * Requires:
- *   "bp" is the address of a free block that is at least "asize" bytes.
- * 	 "remove_flag" is an indicator of whether or not to remove the block.
+ *   Each of the "n" elements of "ptrs" is either the address of an
+ *   allocated block or NULL, and no block occurs twice.
  *
  * Effects:
- *   Place a block of "asize" bytes at the start of the free block "bp" and
- *   split that block if the remainder would be at least the minimum block
- *   size. 
+ *   Frees every block in "ptrs", which is sorted by address, and in which
+ *   the entries of mapped blocks are set to NULL, as a side effect.  Heap
+ *   blocks that are adjacent are merged before they are freed, so each run
+ *   of them is coalesced with its neighbors only once.
  */
-static void
-place(void *bp, size_t asize, bool remove_flag)
+void
+mm_free_batch(void **ptrs, size_t n)
 {
+	struct arena *locked = NULL;
+	struct arena *owner;
+	struct tcache *tc = tcache_self();
+	size_t i, size;
+	void *bp, *next;
 
-	size_t csize = GET_SIZE(HDRP(bp)); 
-
-	if (remove_flag)
-		remove_free(bp);
-
-	if ((csize - asize) >= (2 * DSIZE)) { 
+	/*
+	 * Check, count and unsample every block, and unmap the mapped ones,
+	 * before any arena is locked: like mm_free, the sweep below calls
+	 * neither the profiler nor memlib with an arena lock held.
+	 */
+	qsort(ptrs, n, sizeof(*ptrs), ptr_compare);
+	for (i = 0; i < n; i++) {
+		if ((bp = ptrs[i]) == NULL)
+			continue;
+		guard_check(bp, true);
+		count_free(1, block_size(bp));
+		if (PROF_MAYBE_SAMPLED(bp))
+			prof_free(bp);
+		if (IS_MAPPED(bp)) {
+			mem_unmap(MAP_START(bp));
+			ptrs[i] = NULL;
+		} else if (!IS_SLAB(bp))
+			slab_held(tc, GET_SIZE(HDRP(bp)), -1);
+	}
 
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		bp = NEXT_BLKP(bp);
-		
-		PUT(HDRP(bp), PACK(csize - asize, 0));
-		PUT(FTRP(bp), PACK(csize - asize, 0));
-		insert_free((csize - asize), bp);
+	for (i = 0; i < n; i++) {
+		if ((bp = ptrs[i]) == NULL)
+			continue;
+
+		/* Sorted blocks are grouped by arena, so lock once per group. */
+		owner = ARENA_OF(bp);
+		if (owner != locked) {
+			if (locked != NULL)
+				UNLOCK(locked);
+			LOCK(owner);
+			locked = owner;
+		}
+		if (IS_SLAB(bp)) {
+			slab_free(owner, bp);
+			continue;
+		}
 
-	} else {
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
+		/* Absorb the blocks in "ptrs" that follow this one in the heap. */
+		size = GET_SIZE(HDRP(bp));
+		while (i + 1 < n && ptrs[i + 1] == (next = (char *)bp + size)) {
+			size += GET_SIZE(HDRP(next));
+			i++;
+		}
+		PUT(HDRP(bp), PACK(size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+		heap_free(owner, bp);
 	}
+	if (locked != NULL)
+		UNLOCK(locked);
 }
 
-/* 
- * The remaining routines are heap consistency checker routines. 
- */
-
 /*
  * Requires:
- *   "bp" is the address of a block.
+ *   "opt" is one of the MM_OPT_* tunables in mm.h.
  *
  * Effects:
- *   Perform a minimal check on the block "bp".
+ *   Sets the tunable "opt" to "value".  The setting outlives mm_init,
+ *   but a new placement policy only applies to heaps laid out after it.
+ *   Returns 0 if successful and -1 if "opt" or "value" is invalid.
  */
-static void
-checkblock(void *bp) 
+int
+mm_setopt(int opt, size_t value)
 {
 
-	if ((uintptr_t)bp % WSIZE)
-		printf("Error: %p is not doubleword aligned\n", bp);
-	if (GET(HDRP(bp)) != GET(FTRP(bp)))
-		printf("Error: header does not match footer\n");
+	switch (opt) {
+	case MM_OPT_GROW_MIN:
+	case MM_OPT_GROW_MAX:
+		/* Extensions must keep the heap doubleword aligned. */
+		value = (value + (DSIZE - 1)) & ~(size_t)(DSIZE - 1);
+		if (opt == MM_OPT_GROW_MIN) {
+			if (value == 0 || value > grow_max)
+				return (-1);
+			grow_min = value;
+		} else {
+			if (value < grow_min)
+				return (-1);
+			grow_max = value;
+		}
+		return (0);
+	case MM_OPT_MMAP_THRESHOLD:
+		mmap_threshold = value;
+		return (0);
+	case MM_OPT_TRIM_THRESHOLD:
+		trim_threshold = value;
+		return (0);
+	case MM_OPT_POLICY:
+		if (value != MM_POLICY_LIFO && value != MM_POLICY_ADDRESS &&
+		    value != MM_POLICY_BEST)
+			return (-1);
+		policy = (int)value;
+		return (0);
+	case MM_OPT_DEFER:
+		if (value > UINT_MAX)
+			return (-1);
+		defer_max = (unsigned int)value;
+		return (0);
+	case MM_OPT_BEST_FIT_SCAN:
+		if (value == 0 || value > INT_MAX)
+			return (-1);
+		best_fit_scan = (int)value;
+		return (0);
+	case MM_OPT_PROF_RATE:
+		if (value > PTRDIFF_MAX)
+			return (-1);
+		if (value > 0)
+			prof_init();
+		__atomic_store_n(&prof_rate, value, __ATOMIC_RELAXED);
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns free memory to the system: coalesces all deferred frees, then
+ *   shrinks every arena's heap so that
+ *   at most "pad" free bytes remain at its end, and decommits the pages
+ *   spanned by every other free block.  Returns 1 if any heap was shrunk
+ *   and 0 otherwise.
+ */
+int
+mm_trim(size_t pad)
+{
+	struct arena *ar;
+	struct free_block *current;
+	int i, list;
+	int trimmed = 0;
+
+	for (i = 0; i < NARENAS; i++) {
+		ar = &arenas[i];
+		LOCK(ar);
+		if (ar->heap_listp != NULL) {
+			remote_drain(ar);
+			consolidate(ar);
+			if (heap_trim(ar, pad))
+				trimmed = 1;
+			for (list = 0; list < NLISTS; list++) {
+				for (current = ar->free_listp[list];
+				    current != NULL; current = current->next)
+					decommit_free(current);
+			}
+			tree_decommit(ar->tree);
+		}
+		UNLOCK(ar);
+	}
+	return (trimmed);
+}
+
+/*
+ * Requires:
+ *   "st" points to storage for the statistics.
+ *
+ * Effects:
+ *   Fills in "st" with the allocator's statistics since the last mm_init.
+ *   Each arena is locked in turn, so the figures are not one snapshot.
+ */
+void
+mm_getstats(struct mm_stats *st)
+{
+	struct arena *ar;
+	struct tcache *tc;
+	struct tstats sum;
+	int i, list;
+
+	memset(st, 0, sizeof(*st));
+	st->heap_size = mem_heapsize();
+	st->heap_peak = mem_heap_peak();
+	for (i = 0; i < NARENAS; i++) {
+		ar = &arenas[i];
+		LOCK(ar);
+		if (ar->heap_listp != NULL) {
+			for (list = 0; list < NLISTS; list++)
+				st->free_list[list] += ar->free_bytes[list];
+			st->nextend += ar->nextend;
+			st->nfit += ar->nfit;
+			st->nprobe += ar->nprobe;
+		}
+		UNLOCK(ar);
+	}
+	for (list = 0; list < NLISTS; list++)
+		st->free_bytes += st->free_list[list];
+
+	/* Threads that have not allocated since mm_init count as zero. */
+	LOCK_TCACHES();
+	sum = retired;
+	for (tc = tcaches; tc != NULL; tc = tc->link) {
+		if (tc->epoch == heap_epoch)
+			stats_add(&sum, &tc->stats);
+	}
+	UNLOCK_TCACHES();
+	st->in_use = sum.in_use;
+	st->nmalloc = sum.nmalloc;
+	st->nfree = sum.nfree;
+	st->nrealloc = sum.nrealloc;
+	st->nrealloc_inplace = sum.nrealloc_inplace;
+	st->probe_avg = st->nfit > 0 ? (double)st->nprobe / st->nfit : 0.0;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Writes a heap profile of the sampled blocks to the file "path", in a
+ *   format that pprof reads.  Returns 0 on success and -1 otherwise.
+ */
+int
+mm_prof_dump(const char *path)
+{
+
+	return (prof_dump(path, __atomic_load_n(&prof_rate, __ATOMIC_RELAXED)));
+}
+
+/*
+ * Requires:
+ *   "level" is one of the MM_CHECK_* levels in mm.h.
+ *
+ * Effects:
+ *   Checks every arena's heap for consistency, printing each error that
+ *   it finds, and returns the number of errors.  Each arena is locked in
+ *   turn.  Blocks in thread caches and on remote stacks count as
+ *   allocated.
+ */
+int
+mm_checkheap(int level)
+{
+	struct arena *ar;
+	int errors = 0;
+	int i;
+
+	for (i = 0; i < NARENAS; i++) {
+		ar = &arenas[i];
+		LOCK(ar);
+		if (ar->heap_listp != NULL)
+			errors += checkarena(ar, level);
+		UNLOCK(ar);
+	}
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   mm_init has been called.
+ *
+ * Effects:
+ *   Takes every lock of the allocator and of memlib, for pthread_atfork,
+ *   so that a child of a threaded process does not inherit a lock held by
+ *   a thread that it lacks.  The order is the profiler's lock, then the
+ *   tcache list's, then the arenas' by index, then memlib's; a path that
+ *   holds two at once must take them in that order.  None does: the
+ *   allocator calls the profiler and memlib's mapping routines only with
+ *   no arena lock held, and holds one arena lock at a time.
+ */
+void
+mm_prefork(void)
+{
+	int i;
+
+	prof_prefork();
+	LOCK_TCACHES();
+	for (i = 0; i < NARENAS; i++)
+		LOCK(&arenas[i]);
+	mem_prefork();
+}
+
+/*
+ * Requires:
+ *   The caller holds the locks taken by mm_prefork.
+ *
+ * Effects:
+ *   Releases them, in the parent or in the child after a fork.
+ */
+void
+mm_postfork(void)
+{
+	int i;
+
+	mem_postfork();
+	for (i = NARENAS - 1; i >= 0; i--)
+		UNLOCK(&arenas[i]);
+	UNLOCK_TCACHES();
+	prof_postfork();
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/* 
+ * Requires:
+ *   "ar" is an arena whose heap has not been laid out since mm_init.
+ *
+ * Effects:
+ *   Lay out the prologue, free list array and epilogue of the arena's
+ *   heap in its region.  Returns 0 if successful and -1 otherwise.
+ */
+static int
+arena_init(struct arena *ar)
+{
+	char *heap_listp;
+	void *startp;
+	int i;
+
+	if ((heap_listp = mem_region_sbrk(ar->region, 4 * WSIZE)) ==
+	    (void *)-1)
+		return (-1);
+	PUT(heap_listp, 0);                            /* Alignment padding */
+	PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1 | PREV_ALLOC)); /* Prologue header */ 
+	PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
+	PUT(heap_listp + (3 * WSIZE), PACK(0, 1 | PREV_ALLOC)); /* Epilogue header */
+	heap_listp += (2 * WSIZE);
+
+	if ((startp = mem_region_sbrk(ar->region,
+	    NLISTS * sizeof(struct free_block *) + DSIZE)) == (void *)-1)
+		return (-1);
+	
+	// Set the header and footer, as well an extended epilogue header. 
+	PUT(HDRP(startp), PACK(NLISTS * WSIZE + DSIZE, 1 | PREV_ALLOC));
+	PUT(HDRP(NEXT_BLKP(startp)), PACK(0, 1 | PREV_ALLOC)); /* Epilogue header */
+
+	// Initialize all free lists to null. 
+	ar->free_listp = (struct free_block **)startp;
+	for (i = 0; i < NLISTS; i++) {
+		ar->free_listp[i] = NULL;
+	}
+	ar->fl_bitmap = 0;
+	memset(ar->sl_bitmap, 0, sizeof(ar->sl_bitmap));
+	ar->tree = NULL;
+	ar->policy = policy;
+	memset(ar->quick, 0, sizeof(ar->quick));
+	ar->nquick = 0;
+	memset(ar->partial, 0, sizeof(ar->partial));
+	ar->empty = NULL;
+	memset(ar->slab_open, 0, sizeof(ar->slab_open));
+	ar->clean = mem_region_sbrk(ar->region, 0);
+	ar->heap_listp = heap_listp;
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a newly freed block.
+ *
+ * Effects:
+ *   Perform boundary tag coalescing.  Returns the address of the coalesced
+ *   block.  Since no two free blocks are ever adjacent, the block before
+ *   the coalesced one is allocated, so its header always has PREV_ALLOC.
+ *   If the coalesced block ends the heap, nothing in it before the free
+ *   block that ended the heap, if any, is known to be zero.
+ */
+static void * 
+coalesce(struct arena *ar, void *bp) 
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	bool prev_alloc = GET_PREV_ALLOC(HDRP(bp));  
+	bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp))); 
+	char *next = NEXT_BLKP(bp);
+
+	if (prev_alloc && next_alloc) {                 /* Case 1 */
+	  	insert_free(ar, size, bp);
+	} else if (prev_alloc && !next_alloc) {        /* Case 2 */  
+		remove_free(ar, NEXT_BLKP(bp));
+
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+
+		PUT(HDRP(bp), PACK(size, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(size, PREV_ALLOC));
+		
+		insert_free(ar, size, bp);
+	} else if (!prev_alloc && next_alloc) {         /* Case 3 */
+		remove_free(ar, PREV_BLKP(bp));
+
+		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+
+		PUT(FTRP(bp), PACK(size, PREV_ALLOC));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREV_ALLOC));
+		bp = PREV_BLKP(bp);
+
+		insert_free(ar, size, bp);
+
+	} else {                                        /* Case 4 */
+		remove_free(ar, NEXT_BLKP(bp));
+		remove_free(ar, PREV_BLKP(bp));
+
+		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
+		
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREV_ALLOC));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, PREV_ALLOC));
+	
+		bp = PREV_BLKP(bp);
+		insert_free(ar, size, bp);	
+	}
+	if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+		ar->clean = MAX(ar->clean, next_alloc ? next :
+		    next + sizeof(struct free_block));
+	return (bp);	
+}
+
+/* 
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Extend the heap with a free block and return that block's address.
+ */
+static void *
+extend_heap(struct arena *ar, size_t words) 
+{
+  
+	size_t size;
+	void *bp;
+
+	/* Allocate an even number of words to maintain alignment. */
+	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+	if ((bp = mem_region_sbrk(ar->region, size)) == (void *)-1)  
+		return (NULL);
+	ar->nextend++;
+
+	/*
+	 * Initialize free block header/footer and the epilogue header.  The
+	 * new block starts at the old epilogue, which knows its predecessor.
+	 */
+ 	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)))); /* Free block header */
+	PUT(FTRP(bp), GET(HDRP(bp)));         /* Free block footer */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+
+	return bp;
+}
+
+/*
+ * Requires:
+ *   "need" is a multiple of DSIZE.  The caller holds the lock of arena
+ *   "ar".
+ *
+ * Effects:
+ *   Returns how many bytes to extend the arena's heap by when it is
+ *   "need" bytes short.  The heap grows by a fixed fraction of its size,
+ *   at least grow_min and at most grow_max bytes, so that a growing heap
+ *   calls mem_sbrk a logarithmic number of times; a larger need is met
+ *   exactly.
+ */
+static size_t
+grow_size(struct arena *ar, size_t need)
+{
+	size_t size = (size_t)((char *)mem_region_sbrk(ar->region, 0) -
+	    ar->heap_listp) >> GROW_SHIFT;
+
+	if (size < grow_min)
+		size = grow_min;
+	if (size > grow_max)
+		size = grow_max;
+	size = (size + (DSIZE - 1)) & ~(size_t)(DSIZE - 1);
+	if (size < need)
+		size = need;
+	return (size);
+}
+
+/*
+ * Requires:
+ *   "asize" is the aligned size malloc needs to find a free block for. 
+ *
+ * Effects:
+ *   Find a fit for a block with "asize" bytes.  Returns that block's address
+ *   or NULL if no suitable block was found. 
+ */
+static void *
+find_fit(struct arena *ar, size_t asize)
+{
+
+    struct free_block **free_listp = ar->free_listp;
+    struct free_block *current, *best;
+	size_t rsize = asize;
+	unsigned int map;
+	int idx, fl, sl, seen;
+
+	ar->nfit++;
+
+	/* The size tree, if used, holds every block of TREE_MIN or more. */
+	if (ar->policy != MM_POLICY_LIFO && asize >= TREE_MIN)
+		return (tree_find(ar, asize));
+
+	/*
+	 *  Round asize up to the next subclass boundary.  Every block in that
+	 *  subclass or any larger one fits, so the two bitmaps lead straight
+	 *  to a good fit: the head of the first non-empty list from there.
+	 */
+	if (asize >= SMALL_BLOCK)
+		rsize += ((size_t)1 << (FLOOR_LOG2(asize) - SL_LOG2)) - 1;
+	idx = find_list(rsize);
+	fl = idx >> SL_LOG2;
+	sl = idx & (SL_COUNT - 1);
+	map = ar->sl_bitmap[fl] & (~0u << sl);
+	if (map == 0) {
+		map = ar->fl_bitmap & ~((2u << fl) - 1);
+		if (map != 0) {
+			fl = __builtin_ctz(map);
+			map = ar->sl_bitmap[fl];
+		}
+	}
+	if (map != 0) {
+		idx = fl * SL_COUNT + __builtin_ctz(map);
+		if (ar->policy != MM_POLICY_BEST) {
+			ar->nprobe++;
+			return ((void *)free_listp[idx]);
+		}
+	} else
+		idx = find_list(asize);
+
+	/*
+	 *  Otherwise only asize's own subclass may still hold a fit: first fit
+	 *  it.  Best fit instead scans either list for the smallest of its
+	 *  first best_fit_scan fits.
+	 */
+	best = NULL;
+	seen = 0;
+	for (current = free_listp[idx]; current != NULL &&
+	    seen < best_fit_scan; current = current->next) {
+		ar->nprobe++;
+		if (GET_SIZE(HDRP(current)) < asize)
+			continue;
+		if (ar->policy != MM_POLICY_BEST ||
+		    GET_SIZE(HDRP(current)) == asize)
+			return ((void *)current);
+		if (best == NULL || GET_SIZE(HDRP(current)) <
+		    GET_SIZE(HDRP(best)))
+			best = current;
+		seen++;
+	}
+	if (best != NULL)
+		return ((void *)best);
+
+	/* Failing that, the smallest block in the size tree fits. */
+	if (ar->policy != MM_POLICY_LIFO)
+		return (tree_find(ar, asize));
+
+	/* No fit was found. */
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "asize" is an adjusted block size.  The caller holds the lock of
+ *   arena "ar".
+ *
+ * Effects:
+ *   Allocate a block of "asize" bytes from the arena's free lists,
+ *   extending its heap if no fit is found.  Returns the address of this
+ *   block if the allocation was successful and NULL otherwise.
+ */
+static void *
+heap_malloc(struct arena *ar, size_t asize)
+{
+	void *bp;
+
+	/* Reuse a deferred free of about the same size, if any. */
+	if (ar->nquick > 0 && (bp = quick_get(ar, asize)) != NULL)
+		return (bp);
+
+	if ((bp = heap_fit(ar, asize)) == NULL)
+		return (NULL);
+	place(ar, bp, asize, 1);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "asize" is the adjusted block size of a request for "size" bytes.
+ *   The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   Allocate a block like heap_malloc, and store in "dirty" how many bytes
+ *   at the start of its payload may be nonzero; the rest of the first
+ *   "size" bytes are zero.  The free block that ends the heap holds only
+ *   its links and footer before "ar->clean", and zeros after it, so a
+ *   block carved from it needs little clearing.
+ */
+static void *
+heap_zalloc(struct arena *ar, size_t asize, size_t size, size_t *dirty)
+{
+	size_t csize;
+	char *bp, *zero;
+
+	*dirty = size;
+	if (ar->nquick > 0 && (bp = quick_get(ar, asize)) != NULL)
+		return (bp);
+	if ((bp = heap_fit(ar, asize)) == NULL)
+		return (NULL);
+	csize = GET_SIZE(HDRP(bp));
+	if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) {
+		zero = MAX(ar->clean, bp + sizeof(struct free_block));
+		if (zero < bp + size)
+			*dirty = (size_t)(zero - bp);
+	}
+	place(ar, bp, asize, 1);
+
+	/* A block that took the whole free block keeps its footer. */
+	if (*dirty < size && csize - DSIZE < size)
+		PUT(bp + csize - DSIZE, 0);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "asize" is an adjusted block size.  The caller holds the lock of
+ *   arena "ar".
+ *
+ * Effects:
+ *   Find a free block of at least "asize" bytes in the arena's free lists,
+ *   extending its heap if no fit is found.  Returns the address of this
+ *   block, which stays in the free lists, or NULL if there is none.
+ */
+static void *
+heap_fit(struct arena *ar, size_t asize)
+{
+	size_t tail = 0;   /* Size of the free block ending the heap, if any */
+	char *epilogue, *clean, *fresh;
+	void *bp;
+
+	/*
+	 * Search the free lists for a fit.  On a miss, take back the remote
+	 * frees, coalesce the deferred frees and search once more.
+	 */
+	if ((bp = find_fit(ar, asize)) == NULL &&
+	    (remote_drain(ar) || ar->nquick > 0)) {
+		consolidate(ar);
+		bp = find_fit(ar, asize);
+	}
+	if (bp != NULL)
+		return (bp);
+
+	/*
+	 * No fit found.  Get more memory, merging it with the free block at
+	 * the end of the heap, if any.
+	 */
+	epilogue = HDRP(mem_region_sbrk(ar->region, 0));
+	if (!GET_PREV_ALLOC(epilogue))
+		tail = GET_SIZE(epilogue - WSIZE);
+	clean = (tail > 0) ? MAX(ar->clean, epilogue + WSIZE - tail +
+	    sizeof(struct free_block)) : epilogue + WSIZE;
+	fresh = mem_region_fresh(ar->region);
+	if ((bp = extend_heap(ar, grow_size(ar, asize - tail) / WSIZE)) ==
+	    NULL)
+		return (NULL);
+	bp = coalesce(ar, bp);
+
+	/*
+	 * The new memory is zero from "fresh" on.  If it was merged, clear
+	 * the old footer and epilogue that now lie inside the block, so that
+	 * the old part stays zero from "clean" on.
+	 */
+	if (tail > 0) {
+		PUT(epilogue - WSIZE, 0);
+		PUT(epilogue, 0);
+	}
+	ar->clean = (fresh > epilogue + WSIZE) ? fresh :
+	    MIN(clean, epilogue + WSIZE);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a free block of at least "asize" bytes in
+ *   arena "ar", and "n" is at least one.  The caller holds the arena's
+ *   lock.
+ *
+ * Effects:
+ *   Splits as many as "n" consecutive blocks of "asize" bytes off the
+ *   start of the free block, in one pass, and stores their addresses in
+ *   "out".  The remainder, if any, goes back to the free lists, and the
+ *   last block absorbs a remainder too small to be a block.  Returns the
+ *   number of blocks allocated.
+ */
+static size_t
+heap_carve(struct arena *ar, void *bp, size_t asize, size_t n, void **out)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	size_t rest, i;
+	uintptr_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+
+	remove_free(ar, bp);
+	if (n > csize / asize)
+		n = csize / asize;
+	rest = csize - n * asize;
+	for (i = 0; i < n; i++) {
+		if (i == n - 1 && rest < 2 * DSIZE) {
+			PUT(HDRP(bp), PACK(asize + rest, 1 | prev_alloc));
+			rest = 0;
+		} else
+			PUT(HDRP(bp), PACK(asize, 1 | prev_alloc));
+		prev_alloc = PREV_ALLOC;
+		out[i] = bp;
+		bp = NEXT_BLKP(bp);
+	}
+	if (rest > 0) {
+		PUT(HDRP(bp), PACK(rest, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(rest, PREV_ALLOC));
+		insert_free(ar, rest, bp);
+	} else
+		SET_PREV_ALLOC(HDRP(bp));
+	return (n);
+}
+
+/*
+ * Requires:
+ *   "align" is a power of two greater than DSIZE and "asize" an adjusted
+ *   block size.  The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   Allocate a block of "asize" bytes whose address is a multiple of
+ *   "align" from a free block that is large enough for any misalignment.
+ *   The slack before the aligned address becomes a free block of its own.
+ *   Returns the address of this block if the allocation was successful
+ *   and NULL otherwise.
+ */
+static void *
+heap_memalign(struct arena *ar, size_t align, size_t asize)
+{
+	size_t csize, slack;
+	char *bp, *abp;
+
+	/* Any slack must be able to hold a minimum-sized free block. */
+	if ((bp = heap_fit(ar, asize + align + 2 * DSIZE)) == NULL)
+		return (NULL);
+	abp = (char *)(((uintptr_t)bp + align - 1) & ~(uintptr_t)(align - 1));
+	if (abp > bp && (size_t)(abp - bp) < 2 * DSIZE)
+		abp += align;
+	if (abp == bp) {
+		place(ar, bp, asize, 1);
+		return (bp);
+	}
+
+	// Split off the slack as a free block, then place at abp.
+	csize = GET_SIZE(HDRP(bp));
+	slack = (size_t)(abp - bp);
+	remove_free(ar, bp);
+	PUT(HDRP(bp), PACK(slack, GET_PREV_ALLOC(HDRP(bp))));
+	PUT(FTRP(bp), GET(HDRP(bp)));
+	insert_free(ar, slack, bp);
+	PUT(HDRP(abp), PACK(csize - slack, 0));
+	place(ar, abp, asize, 0);
+	return (abp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block in arena "ar".  The caller
+ *   holds the arena's lock.
+ *
+ * Effects:
+ *   Free the block.  If frees are deferred, the block goes to the quick
+ *   list for its size, still marked allocated, and is coalesced in a
+ *   later batch; otherwise it is released at once.
+ */
+static void
+heap_free(struct arena *ar, void *bp)
+{
+	struct free_block *block = (struct free_block *)bp;
+	size_t size = GET_SIZE(HDRP(bp));
+	int idx;
+
+	if (defer_max == 0 || size >= trim_threshold) {
+		heap_release(ar, bp);
+		return;
+	}
+	idx = find_list(size);
+	block->next = ar->quick[idx];
+	ar->quick[idx] = block;
+	if (++ar->nquick > defer_max)
+		consolidate(ar);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block in arena "ar".  The caller
+ *   holds the arena's lock.
+ *
+ * Effects:
+ *   Return the block to the arena's free lists, coalescing it with its
+ *   neighbors.
+ */
+static void
+heap_release(struct arena *ar, void *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	// Set the allocation flags of the block to free, and tell the next
+	// block.  Coalesce the newly freed block. 
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+	PUT(FTRP(bp), GET(HDRP(bp)));
+	CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	bp = coalesce(ar, bp); 
+
+	// Give a large free block's memory back: shrink the heap if the
+	// block ends it, and otherwise decommit the pages it spans.
+	if (GET_SIZE(HDRP(bp)) >= trim_threshold) {
+		if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+			heap_trim(ar, grow_min);
+		else
+			decommit_free(bp);
+	}
+}
+
+/*
+ * Requires:
+ *   "asize" is an adjusted block size.  The caller holds the lock of
+ *   arena "ar".
+ *
+ * Effects:
+ *   Removes a deferred free of at least "asize" bytes from the quick list
+ *   for its size and returns it, trimmed to "asize" bytes, or returns NULL
+ *   if that list holds no such block.
+ */
+static void *
+quick_get(struct arena *ar, size_t asize)
+{
+	struct free_block **linkp;
+	struct free_block *current;
+
+	for (linkp = &ar->quick[find_list(asize)]; (current = *linkp) != NULL;
+	    linkp = &current->next) {
+		if (GET_SIZE(HDRP(current)) >= asize) {
+			*linkp = current->next;
+			ar->nquick--;
+			shrink_block(ar, current, asize);
+			return ((void *)current);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   Releases every deferred free in the arena, coalescing each with its
+ *   free neighbors.
+ */
+static void
+consolidate(struct arena *ar)
+{
+	struct free_block *current;
+	int i;
+
+	for (i = 0; i < NLISTS && ar->nquick > 0; i++) {
+		while ((current = ar->quick[i]) != NULL) {
+			ar->quick[i] = current->next;
+			ar->nquick--;
+			heap_release(ar, current);
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   If the arena's heap ends with a free block that is more than "pad"
+ *   bytes, shrink the heap by whole pages so that at most "pad" bytes of
+ *   it remain.  Returns true if the heap was shrunk and false otherwise.
+ */
+static bool
+heap_trim(struct arena *ar, size_t pad)
+{
+	char *epilogue = HDRP(mem_region_sbrk(ar->region, 0));
+	size_t pagesize = mem_pagesize();
+	size_t size, release;
+	void *bp;
+
+	if (GET_PREV_ALLOC(epilogue))
+		return (false);
+	size = GET_SIZE(epilogue - WSIZE);
+	bp = epilogue + WSIZE - size;
+	pad = (pad + (DSIZE - 1)) & ~(size_t)(DSIZE - 1);
+	if (size <= pad)
+		return (false);
+
+	// Release whole pages, leaving either nothing or a valid block.
+	release = (size - pad) & ~(pagesize - 1);
+	if (release < size && size - release < 2 * DSIZE)
+		release -= pagesize;
+	if (release == 0)
+		return (false);
+
+	remove_free(ar, bp);
+	if (release < size) {
+		PUT(HDRP(bp), PACK(size - release, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(size - release, PREV_ALLOC));
+		insert_free(ar, size - release, bp);
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));  /* New epilogue header */
+	} else
+		PUT(HDRP(bp), PACK(0, 1 | PREV_ALLOC)); /* New epilogue header */
+	mem_region_sbrk(ar->region, -(intptr_t)release);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a free block.
+ *
+ * Effects:
+ *   Decommit the pages that lie wholly within the block, keeping its
+ *   header, free list links and footer.
+ */
+static void
+decommit_free(void *bp)
+{
+	char *lo = (char *)bp + sizeof(struct free_block);
+
+	mem_decommit(lo, (size_t)(FTRP(bp) - lo));
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block in arena "ar" and "asize"
+ *   an adjusted block size.  The caller holds the arena's lock.
+ *
+ * Effects:
+ *   Resizes the block "bp" to "asize" bytes without copying it to a new
+ *   block.  A shrink splits off the tail.  A growth absorbs a free
+ *   successor, then an exactly fitting free predecessor, into which the
+ *   payload slides down, or extends the heap if the block ends it.
+ *   Returns the address of the resized block, which differs from "bp"
+ *   only if the predecessor was absorbed, or NULL if the block cannot grow
+ *   in place.
+ */
+static void *
+heap_realloc(struct arena *ar, void *bp, size_t asize)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	size_t nsize;   /* Size of the free successor, if any */
+	void *next = NEXT_BLKP(bp);
+	void *prev, *tail;
+
+	nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+	if (asize > size + nsize) {
+		/*
+		 * Slide the payload down into a free predecessor only if that
+		 * leaves no remainder: copying to a new block and coalescing
+		 * the old one fragments the heap less than splitting here.
+		 */
+		if (!GET_PREV_ALLOC(HDRP(bp)) &&
+		    GET_SIZE(HDRP(PREV_BLKP(bp))) + size + nsize >= asize &&
+		    GET_SIZE(HDRP(PREV_BLKP(bp))) + size + nsize <
+		    asize + 2 * DSIZE) {
+			prev = PREV_BLKP(bp);
+			remove_free(ar, prev);
+			memmove(prev, bp, size - WSIZE);
+			size += GET_SIZE(HDRP(prev));
+			bp = prev;
+		} else if (GET_SIZE(HDRP(nsize > 0 ? NEXT_BLKP(next) :
+		    next)) == 0) {
+			/* The block ends the heap, so extend the heap under it. */
+			if ((tail = extend_heap(ar, grow_size(ar,
+			    asize - size - nsize) / WSIZE)) == NULL)
+				return (NULL);
+			size += GET_SIZE(HDRP(tail));
+		} else if (ar->nquick > 0) {
+			/* A neighbor may be a deferred free: coalesce, retry. */
+			consolidate(ar);
+			return (heap_realloc(ar, bp, asize));
+		} else
+			return (NULL);
+	}
+	if (nsize > 0) {
+		remove_free(ar, next);
+		size += nsize;
+	}
+	PUT(HDRP(bp), PACK(size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+	SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	shrink_block(ar, bp, asize);
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block in arena "ar" that is at
+ *   least "asize" bytes.  The caller holds the arena's lock.
+ *
+ * Effects:
+ *   Shrink the block "bp" to "asize" bytes if the remainder would be at
+ *   least the minimum block size, and free that remainder.
+ */
+static void
+shrink_block(struct arena *ar, void *bp, size_t asize)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	void *rest;
+
+	if ((size - asize) >= (2 * DSIZE)) {
+		PUT(HDRP(bp), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(bp))));
+		rest = NEXT_BLKP(bp);
+		PUT(HDRP(rest), PACK(size - asize, 1 | PREV_ALLOC));
+		heap_free(ar, rest);
+	}
+}
+
+/* 
+ * Requires:
+ *   "bp" is the address of a free block that is at least "asize" bytes.
+ * 	 "remove_flag" is an indicator of whether or not to remove the block.
+ *
+ * Effects:
+ *   Place a block of "asize" bytes at the start of the free block "bp" and
+ *   split that block if the remainder would be at least the minimum block
+ *   size. 
+ */
+static void
+place(struct arena *ar, void *bp, size_t asize, bool remove_flag)
+{
+
+	size_t csize = GET_SIZE(HDRP(bp)); 
+
+	if (remove_flag)
+		remove_free(ar, bp);
+
+	if ((csize - asize) >= (2 * DSIZE)) { 
+
+		PUT(HDRP(bp), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(bp))));
+		bp = NEXT_BLKP(bp);
+		
+		PUT(HDRP(bp), PACK(csize - asize, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(csize - asize, PREV_ALLOC));
+		insert_free(ar, (csize - asize), bp);
+
+	} else {
+		PUT(HDRP(bp), PACK(csize, 1 | GET_PREV_ALLOC(HDRP(bp))));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	}
+}
+
+/*
+ * The following routines manage the size trees.
+ */
+
+/*
+ * Requires:
+ *   "node" is a free block of at least TREE_MIN bytes that is in no tree,
+ *   and "linkp" the link to the root of a tree.
+ *
+ * Effects:
+ *   Inserts "node" into the tree.
+ */
+static void
+tree_insert(struct tree_block **linkp, struct tree_block *node)
+{
+	struct tree_block **lp, **rp;
+	struct tree_block *t;
+
+	/* Descend past the nodes that outrank "node". */
+	while ((t = *linkp) != NULL && TREE_PRIO(t) > TREE_PRIO(node))
+		linkp = TREE_LESS(node, t) ? &t->left : &t->right;
+
+	/* Split the rest of the subtree around "node" to form its children. */
+	lp = &node->left;
+	rp = &node->right;
+	while (t != NULL) {
+		if (TREE_LESS(t, node)) {
+			*lp = t;
+			lp = &t->right;
+			t = t->right;
+		} else {
+			*rp = t;
+			rp = &t->left;
+			t = t->left;
+		}
+	}
+	*lp = *rp = NULL;
+	*linkp = node;
+}
+
+/*
+ * Requires:
+ *   "node" is in the tree whose root "linkp" links to, and its size has
+ *   not changed since it was inserted.
+ *
+ * Effects:
+ *   Removes "node" from the tree.
+ */
+static void
+tree_remove(struct tree_block **linkp, struct tree_block *node)
+{
+	struct tree_block *l = node->left;
+	struct tree_block *r = node->right;
+
+	while (*linkp != node)
+		linkp = TREE_LESS(node, *linkp) ? &(*linkp)->left :
+		    &(*linkp)->right;
+
+	/* Merge the node's subtrees in its place. */
+	while (l != NULL && r != NULL) {
+		if (TREE_PRIO(l) > TREE_PRIO(r)) {
+			*linkp = l;
+			linkp = &l->right;
+			l = l->right;
+		} else {
+			*linkp = r;
+			linkp = &r->left;
+			r = r->left;
+		}
+	}
+	*linkp = (l != NULL) ? l : r;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the smallest, and of those the lowest, block in the size tree
+ *   of arena "ar" that is at least "asize" bytes, or NULL if there is
+ *   none.
+ */
+static void *
+tree_find(struct arena *ar, size_t asize)
+{
+	struct tree_block *best = NULL;
+	struct tree_block *t = ar->tree;
+
+	while (t != NULL) {
+		ar->nprobe++;
+		if (GET_SIZE(HDRP(t)) >= asize) {
+			best = t;
+			t = t->left;
+		} else
+			t = t->right;
+	}
+	return ((void *)best);
+}
+
+/*
+ * Requires:
+ *   "t" is the root of a tree or NULL.
+ *
+ * Effects:
+ *   Decommits the pages spanned by every block in the tree.
+ */
+static void
+tree_decommit(struct tree_block *t)
+{
+
+	for (; t != NULL; t = t->right) {
+		tree_decommit(t->left);
+		decommit_free(t);
+	}
+}
+
+/*
+ * The following routines manage the slabs.
+ */
+
+/*
+ * Requires:
+ *   "size" is a request that fits in a slab, and "tc" is the calling
+ *   thread's cache.
+ *
+ * Effects:
+ *   Returns true if the request's class uses slabs in arena "ar".  A
+ *   class is opened once the thread holds enough heap blocks of its size
+ *   to fill a slab, and stays open until mm_init.
+ */
+static bool
+slab_use(struct arena *ar, struct tcache *tc, size_t size)
+{
+	int c = SLAB_CLASS(SLOT_SIZE(size));
+
+	if (__atomic_load_n(&ar->slab_open[c], __ATOMIC_RELAXED))
+		return (true);
+	if (tc->slab_live[SLAB_LIVE(ASIZE(size))] <
+	    (int)(SLAB_SIZE / SLOT_SIZE(size)))
+		return (false);
+	__atomic_store_n(&ar->slab_open[c], true, __ATOMIC_RELAXED);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "tc" is the calling thread's cache.
+ *
+ * Effects:
+ *   Counts "n" heap blocks of "bsize" bytes as allocated by the thread,
+ *   or as freed if "n" is negative, if blocks of that size would be slots
+ *   once their class opens.
+ */
+static void
+slab_held(struct tcache *tc, size_t bsize, int n)
+{
+
+	if (SLAB_CLASSES > 0 && bsize <= SLAB_HEAP_MAX)
+		tc->slab_live[SLAB_LIVE(bsize)] += n;
+}
+
+/*
+ * Requires:
+ *   "ssize" is a slot size of at most MM_SLAB_MAX bytes.  The caller holds
+ *   the lock of arena "ar".
+ *
+ * Effects:
+ *   Allocates a slot of "ssize" bytes from one of the arena's slabs,
+ *   preferring a partly used slab of that class, then an unused slab.  If
+ *   "grow" is true and neither exists, a new slab is taken from the
+ *   arena's slab region.  Returns the slot's address, or NULL.
+ */
+static void *
+slab_alloc(struct arena *ar, size_t ssize, bool grow)
+{
+	struct slab *slab;
+	int c = SLAB_CLASS(ssize);
+	int i, w;
+
+	/* On a miss, the remote frees may bring back a slot. */
+	if ((slab = ar->partial[c]) == NULL && remote_drain(ar))
+		slab = ar->partial[c];
+	if (slab == NULL) {
+		if ((slab = ar->empty) != NULL)
+			slab_unlink(&ar->empty, slab);
+		else if (!grow || (slab = mem_region_sbrk(NARENAS + ar->region,
+		    SLAB_SIZE)) == (void *)-1)
+			return (NULL);
+
+		/* (Re)format the slab for this class. */
+		slab->size = ssize;
+		slab->first = (sizeof(struct slab) + DSIZE - 1) & ~(DSIZE - 1);
+		slab->nslots = (SLAB_SIZE - slab->first) / ssize;
+		slab->nfree = slab->nslots;
+		for (w = 0; w < SLAB_MAPWORDS; w++) {
+			i = slab->nslots - w * 64;
+			slab->map[w] = i >= 64 ? 0 : i <= 0 ? ~(uint64_t)0 :
+			    ~(uint64_t)0 << i;
+		}
+		slab_push(&ar->partial[c], slab);
+	}
+
+	/* A partial slab has a clear bit; take the lowest one. */
+	for (w = 0; slab->map[w] == ~(uint64_t)0; w++)
+		continue;
+	i = __builtin_ctzll(~slab->map[w]);
+	slab->map[w] |= (uint64_t)1 << i;
+	if (--slab->nfree == 0)
+		slab_unlink(&ar->partial[c], slab);
+	return ((char *)slab + slab->first + (w * 64 + i) * slab->size);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated slot in one of arena "ar"'s
+ *   slabs.  The caller holds the lock of "ar".
+ *
+ * Effects:
+ *   Frees the slot.  A slab that becomes unused is kept as its class's
+ *   only partial slab, or else moved to the arena's unused slabs.
+ */
+static void
+slab_free(struct arena *ar, void *bp)
+{
+	struct slab *slab = SLAB_OF(bp);
+	int c = SLAB_CLASS(slab->size);
+	unsigned int i;
+
+	i = ((char *)bp - (char *)slab - slab->first) / slab->size;
+	slab->map[i / 64] &= ~((uint64_t)1 << (i % 64));
+	if (slab->nfree++ == 0)
+		slab_push(&ar->partial[c], slab);
+	if (slab->nfree == slab->nslots &&
+	    (slab->prev != NULL || slab->next != NULL)) {
+		slab_unlink(&ar->partial[c], slab);
+		slab_push(&ar->empty, slab);
+	}
+}
+
+/*
+ * Requires:
+ *   "slab" is on the list "listp".
+ *
+ * Effects:
+ *   Removes "slab" from the list "listp".
+ */
+static void
+slab_unlink(struct slab **listp, struct slab *slab)
+{
+
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		*listp = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+}
+
+/*
+ * Requires:
+ *   "slab" is on no list.
+ *
+ * Effects:
+ *   Pushes "slab" onto the front of the list "listp".
+ */
+static void
+slab_push(struct slab **listp, struct slab *slab)
+{
+
+	slab->prev = NULL;
+	slab->next = *listp;
+	if (*listp != NULL)
+		(*listp)->prev = slab;
+	*listp = slab;
+}
+
+/*
+ * The following routines manage the blocks that have mappings of their own.
+ * Such a block starts at least DSIZE bytes into its mapping, after a word
+ * that holds the mapping's start and a header that holds the size of the
+ * whole mapping.  In guard mode, the mapping's last word is the canary.
+ */
+
+/*
+ * Requires:
+ *   "align" is a power of two that is at least DSIZE.
+ *
+ * Effects:
+ *   Allocates a block of at least "size" bytes of payload, aligned to
+ *   "align" bytes, in a new mapping.  Returns the address of the block, or
+ *   NULL on failure.
+ */
+static void *
+map_alloc(size_t size, size_t align)
+{
+	size_t pagesize = mem_pagesize();
+	size_t lead = MIN(align, pagesize); /* From mapping start to block */
+	size_t msize = map_size(lead + size + GUARD_SIZE);
+	char *p;
+
+	if ((p = mem_map_aligned(msize, MAX(align, pagesize), lead)) == NULL)
+		return (NULL);
+	return (map_block(p, msize, lead));
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a mapped block.
+ *
+ * Effects:
+ *   Resizes the mapping of block "bp" so that it holds at least "size"
+ *   bytes of payload, moving it if need be.  Returns the address of the
+ *   block, or NULL, leaving the block alone, on failure.
+ */
+static void *
+map_realloc(void *bp, size_t size)
+{
+	char *start = MAP_START(bp);
+	size_t lead = (size_t)((char *)bp - start);
+	size_t msize = map_size(lead + size + GUARD_SIZE);
+	char *p;
+
+	if (msize == GET_SIZE(HDRP(bp)))
+		return (bp);
+	if ((p = mem_remap(start, msize)) == NULL)
+		return (NULL);
+	return (map_block(p, msize, lead));
+}
+
+/*
+ * Requires:
+ *   "p" is the start of a mapping of "msize" bytes, and "lead" is a
+ *   multiple of DSIZE that is less than "msize".
+ *
+ * Effects:
+ *   Lays out a mapped block "lead" bytes into the mapping and returns its
+ *   address.
+ */
+static void *
+map_block(char *p, size_t msize, size_t lead)
+{
+	char *bp = p + lead;
+
+	PUT(bp - DSIZE, (uintptr_t)p);
+	PUT(HDRP(bp), PACK(msize, 1));
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the size of a mapping of at least "size" bytes.
+ */
+static size_t
+map_size(size_t size)
+{
+	size_t pagesize = mem_pagesize();
+
+	return ((size + pagesize - 1) / pagesize * pagesize);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to block addresses.
+ *
+ * Effects:
+ *   Orders block addresses for qsort.
+ */
+static int
+ptr_compare(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)*(void *const *)a;
+	uintptr_t pb = (uintptr_t)*(void *const *)b;
+
+	return ((pa > pb) - (pa < pb));
+}
+
+/*
+ * Requires:
+ *   "p" is the address of "n" writable bytes.
+ *
+ * Effects:
+ *   Clears the bytes.  A run of ZERO_STREAM or more bytes is much larger
+ *   than the caches, so on SSE2 it is cleared by streaming stores, which
+ *   write whole lines to memory without reading them in or evicting the
+ *   caller's working set.
+ */
+static void
+zero_fill(void *p, size_t n)
+{
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	char *cp = p;
+	size_t head;
+
+	if (n >= ZERO_STREAM) {
+		head = (size_t)(-(uintptr_t)cp & 63);
+		memset(cp, 0, head);
+		for (cp += head, n -= head; n >= 64; cp += 64, n -= 64) {
+			_mm_stream_si128((__m128i *)cp, zero);
+			_mm_stream_si128((__m128i *)cp + 1, zero);
+			_mm_stream_si128((__m128i *)cp + 2, zero);
+			_mm_stream_si128((__m128i *)cp + 3, zero);
+		}
+		_mm_sfence();
+		p = cp;
+	}
+#endif
+	memset(p, 0, n);
+}
+
+/*
+ * The following routines manage the per-thread caches.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the calling thread's cache, emptying it first if it still
+ *   holds blocks from before the last mm_init.  A thread is assigned an
+ *   arena of the node it runs on, round robin, the first time it uses a
+ *   cache after mm_init.
+ */
+static struct tcache *
+tcache_self(void)
+{
+	struct tcache *tc = &tcache;
+	unsigned int n;
+	int node;
+
+	if (tc->epoch != heap_epoch) {
+		/* Reset under the lock, as mm_getstats may be reading. */
+		LOCK_TCACHES();
+		memset(tc, 0, offsetof(struct tcache, link));
+		tc->epoch = heap_epoch;
+		if (!tc->listed) {
+			tc->link = tcaches;
+			tcaches = tc;
+			tc->listed = true;
+		}
+		UNLOCK_TCACHES();
+		node = (nnodes > 1) ? mem_numa_node() % nnodes : 0;
+		n = __atomic_fetch_add(&next_arena[node], 1, __ATOMIC_RELAXED);
+		tc->arena = node_arena(node, n);
+#if MM_THREADS
+		/* Any non-NULL value makes the key's destructor run. */
+		pthread_setspecific(tcache_key, tc);
+#endif
+	}
+	return (tc);
+}
+
+/*
+ * Requires:
+ *   "node" is less than nnodes.
+ *
+ * Effects:
+ *   Returns the arena in position "n", modulo their number, among the
+ *   arenas of NUMA node "node".
+ */
+static struct arena *
+node_arena(int node, unsigned int n)
+{
+	unsigned int count = (NARENAS - node + nnodes - 1) / nnodes;
+
+	return (&arenas[node + nnodes * (int)(n % count)]);
+}
+
+/*
+ * Requires:
+ *   "idx" is the bin for "asize", which is either an adjusted block size
+ *   of at most TCACHE_MAX bytes or a slot size.
+ *
+ * Effects:
+ *   Removes and returns a cached block of at least "asize" bytes, or
+ *   returns NULL if this thread's cache has none.  Does not lock.
+ */
+static void *
+tcache_get(int idx, size_t asize)
+{
+	struct tcache *tc = tcache_self();
+	struct free_block **linkp;
+	struct free_block *current;
+
+	/*
+	 * All slots in a slab bin have the same size, but a block bin holds a
+	 * size range, so first fit over its few entries.
+	 */
+	for (linkp = &tc->bins[idx]; (current = *linkp) != NULL;
+	    linkp = &current->next) {
+		if (idx >= TCACHE_BINS || GET_SIZE(HDRP(current)) >= asize) {
+			*linkp = current->next;
+			tc->counts[idx]--;
+			return ((void *)current);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block of at most TCACHE_MAX bytes
+ *   or of a slot, and "idx" is its bin.
+ *
+ * Effects:
+ *   Caches the block in this thread's cache.  If its bin is full, half of
+ *   the bin is first returned to the owning arenas.
+ */
+static void
+tcache_put(void *bp, int idx)
+{
+	struct tcache *tc = tcache_self();
+	struct free_block *block = (struct free_block *)bp;
+
+	if (tc->counts[idx] >= TCACHE_COUNT)
+		tcache_flush(tc, idx, TCACHE_COUNT / 2);
+	block->next = tc->bins[idx];
+	tc->bins[idx] = block;
+	tc->counts[idx]++;
+}
+
+/*
+ * Requires:
+ *   "idx" is the bin for "asize", as for tcache_get.  The caller holds the
+ *   lock of this thread's arena "ar".
+ *
+ * Effects:
+ *   Carves up to TCACHE_FILL more blocks of "asize" bytes out of existing
+ *   free blocks or slabs and caches them.  Never extends the heap.
+ */
+static void
+tcache_fill(struct arena *ar, int idx, size_t asize)
+{
+	struct tcache *tc = tcache_self();
+	struct free_block *block;
+	int i;
+
+	for (i = 0; i < TCACHE_FILL && tc->counts[idx] < TCACHE_COUNT; i++) {
+		if (idx >= TCACHE_BINS) {
+			if ((block = slab_alloc(ar, asize, false)) == NULL)
+				return;
+		} else {
+			if ((block = find_fit(ar, asize)) == NULL)
+				return;
+			place(ar, block, asize, 1);
+		}
+		block->next = tc->bins[idx];
+		tc->bins[idx] = block;
+		tc->counts[idx]++;
+	}
+}
+
+/*
+ * Requires:
+ *   "tc" is a thread cache, "idx" a bin index.  The caller holds no
+ *   arena lock.
+ *
+ * Effects:
+ *   Returns up to "count" blocks from bin "idx" to the free lists or slabs
+ *   of the arenas that own them, taking each arena's lock once per run of
+ *   blocks it owns.
+ */
+static void
+tcache_flush(struct tcache *tc, int idx, unsigned int count)
+{
+	struct arena *locked = NULL;
+	struct arena *owner;
+	struct free_block *block;
+
+	while (count-- > 0 && (block = tc->bins[idx]) != NULL) {
+		tc->bins[idx] = block->next;
+		tc->counts[idx]--;
+		owner = ARENA_OF(block);
+		if (owner != tc->arena) {
+			remote_push(owner, block);
+			continue;
+		}
+		if (owner != locked) {
+			if (locked != NULL)
+				UNLOCK(locked);
+			LOCK(owner);
+			locked = owner;
+		}
+		if (idx >= TCACHE_BINS)
+			slab_free(owner, block);
+		else
+			heap_free(owner, block);
+	}
+	if (locked != NULL)
+		UNLOCK(locked);
 }
 
-/* 
+#if MM_THREADS
+/*
  * Requires:
  *   None.
  *
  * Effects:
- *   Perform a minimal check of the heap for consistency. 
+ *   Creates the arena locks and the key whose destructor flushes a
+ *   thread's cache when the thread exits.
  */
-void
-checkheap(bool verbose) 
+static void
+mm_once(void)
+{
+	int i;
+
+	for (i = 0; i < NARENAS; i++)
+		pthread_mutex_init(&arenas[i].lock, NULL);
+	pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * Requires:
+ *   "arg" is the exiting thread's cache.
+ *
+ * Effects:
+ *   Returns every block in the cache to its arena, unless the heap was
+ *   reinitialized since they were cached, and retires the thread's
+ *   counters.
+ */
+static void
+tcache_release(void *arg)
+{
+	struct tcache *tc = (struct tcache *)arg;
+	struct tcache **linkp;
+	int i;
+
+	if (tc->epoch == heap_epoch) {
+		for (i = 0; i < TCACHE_NBINS; i++)
+			tcache_flush(tc, i, TCACHE_COUNT);
+	}
+
+	/* Keep the thread's counters, but forget its cache. */
+	LOCK_TCACHES();
+	if (tc->epoch == heap_epoch)
+		stats_add(&retired, &tc->stats);
+	for (linkp = &tcaches; *linkp != tc; linkp = &(*linkp)->link)
+		continue;
+	*linkp = tc->link;
+	tc->listed = false;
+	UNLOCK_TCACHES();
+}
+#endif
+
+/*
+ * The following routines keep the statistics.
+ */
+
+/*
+ * Requires:
+ *   "bp" is NULL or the address of a block of "bsize" bytes that was just
+ *   allocated.
+ *
+ * Effects:
+ *   Counts the allocation, if any, against the calling thread, and arms
+ *   the block's canary in guard mode.  Returns "bp".
+ */
+static void *
+count_alloc(void *bp, size_t bsize)
+{
+	struct tcache *tc;
+
+	if (bp != NULL) {
+		guard_arm(bp);
+		tc = tcache_self();
+		STAT_ADD(tc->stats.nmalloc, 1);
+		STAT_ADD(tc->stats.in_use, bsize);
+		if ((tc->prof_left -= (ptrdiff_t)bsize) < 0)
+			prof_tick(tc, bp, bsize);
+	}
+	return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block of "bsize" bytes that was just
+ *   allocated by the thread whose cache is "tc", and that took its
+ *   countdown to the next sample below zero.
+ *
+ * Effects:
+ *   Samples the block for the heap profiler, if it is on, and restarts
+ *   the countdown.  A thread's first countdown only seeds its random
+ *   state, so that it starts at a random point.
+ */
+static void
+prof_tick(struct tcache *tc, void *bp, size_t bsize)
+{
+	size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+
+	if (rate == 0) {
+		tc->prof_left = PROF_RECHECK;
+		return;
+	}
+	if (tc->prof_seed == 0)
+		tc->prof_seed = ((uintptr_t)tc ^ (uint64_t)heap_epoch << 32) | 1;
+	else
+		prof_sample(bp, bsize);
+	tc->prof_left = (ptrdiff_t)prof_interval(rate, &tc->prof_seed);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Counts "n" frees of "bytes" bytes in all against the calling thread.
+ */
+static void
+count_free(unsigned long n, size_t bytes)
+{
+	struct tstats *st = &tcache_self()->stats;
+
+	STAT_ADD(st->nfree, n);
+	STAT_ADD(st->in_use, -bytes);
+}
+
+/*
+ * Requires:
+ *   "bp" is NULL or the address of an allocated block or slot.
+ *
+ * Effects:
+ *   Returns the number of bytes that the block occupies, which for a
+ *   mapped block is its whole mapping, or 0 if "bp" is NULL.
+ */
+static size_t
+block_size(void *bp)
+{
+
+	if (bp == NULL)
+		return (0);
+	if (IS_SLAB(bp))
+		return (SLAB_OF(bp)->size);
+	return (GET_SIZE(HDRP(bp)));
+}
+
+/*
+ * Requires:
+ *   "st" is the counters of a live thread, or retired ones.  The caller
+ *   holds tcaches_lock, if there is one.
+ *
+ * Effects:
+ *   Adds the counters "st" to "sum".
+ */
+static void
+stats_add(struct tstats *sum, const struct tstats *st)
+{
+
+	sum->nmalloc += __atomic_load_n(&st->nmalloc, __ATOMIC_RELAXED);
+	sum->nfree += __atomic_load_n(&st->nfree, __ATOMIC_RELAXED);
+	sum->nrealloc += __atomic_load_n(&st->nrealloc, __ATOMIC_RELAXED);
+	sum->nrealloc_inplace += __atomic_load_n(&st->nrealloc_inplace,
+	    __ATOMIC_RELAXED);
+	sum->in_use += __atomic_load_n(&st->in_use, __ATOMIC_RELAXED);
+}
+
+/*
+ * The following routines manage the remote stacks, which are lock-free
+ * stacks with many producers and one consumer at a time: the holder of
+ * the arena's lock, which pops every block at once.  Blocks on a remote
+ * stack stay marked allocated and are linked through "next".
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block or slot of arena "ar".
+ *
+ * Effects:
+ *   Pushes the block onto the arena's remote stack, without locking.
+ */
+static void
+remote_push(struct arena *ar, void *bp)
+{
+	struct free_block *block = (struct free_block *)bp;
+
+	block->next = __atomic_load_n(&ar->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ar->remote, &block->next, block,
+	    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		continue;
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   Frees every block on the arena's remote stack.  Returns true if there
+ *   were any.
+ */
+static bool
+remote_drain(struct arena *ar)
+{
+	struct free_block *block, *next;
+
+	if (__atomic_load_n(&ar->remote, __ATOMIC_RELAXED) == NULL)
+		return (false);
+	block = __atomic_exchange_n(&ar->remote, NULL, __ATOMIC_ACQUIRE);
+	for (; block != NULL; block = next) {
+		next = block->next;
+		if (IS_SLAB(block))
+			slab_free(ar, block);
+		else
+			heap_free(ar, block);
+	}
+	return (true);
+}
+
+#if MM_GUARD
+/*
+ * The following routines implement guard mode.  The canary of a block is
+ * its last word: the footer position of a heap block, or the last word of
+ * a slot or of a mapping.  A live block's canary is CANARY(bp), and a
+ * freed block's is its complement until the word is reused.
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of a block, slot or mapped block.
+ *
+ * Effects:
+ *   Returns the address of the block's canary.
+ */
+static uintptr_t *
+guard_word(void *bp)
+{
+
+	if (IS_MAPPED(bp))
+		return ((uintptr_t *)(MAP_START(bp) + GET_SIZE(HDRP(bp)) -
+		    WSIZE));
+	if (IS_SLAB(bp))
+		return ((uintptr_t *)((char *)bp + SLAB_OF(bp)->size - WSIZE));
+	return ((uintptr_t *)FTRP(bp));
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block that was just allocated or resized.
+ *
+ * Effects:
+ *   Sets the block's canary.
+ */
+static void
+guard_arm(void *bp)
+{
+
+	*guard_word(bp) = CANARY(bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block that the application passed in.
+ *
+ * Effects:
+ *   Aborts if the block is not allocated or its canary was overwritten.
+ *   If "freeing" is true, the block is about to be freed: marks its canary
+ *   freed and poisons up to GUARD_POISON bytes of its payload, after the
+ *   words that the free routines link through.  The smallest slots have
+ *   their canary in a link word, so a double free of one is reported as
+ *   an overrun.
+ */
+static void
+guard_check(void *bp, bool freeing)
+{
+	uintptr_t *canary;
+	char *lo = (char *)bp + sizeof(struct free_block);
+
+	if (!IS_MAPPED(bp) && !IS_SLAB(bp) && !GET_ALLOC(HDRP(bp)))
+		guard_fail(bp, freeing ? "double free" : "use after free");
+	canary = guard_word(bp);
+	if (*canary == ~CANARY(bp))
+		guard_fail(bp, freeing ? "double free" : "use after free");
+	if (*canary != CANARY(bp))
+		guard_fail(bp, "overrun");
+	if (freeing) {
+		*canary = ~CANARY(bp);
+		if ((char *)canary > lo)
+			memset(lo, GUARD_BYTE, MIN((size_t)((char *)canary - lo),
+			    GUARD_POISON));
+	}
+}
+
+/*
+ * Requires:
+ *   "what" describes the misuse of block "bp".
+ *
+ * Effects:
+ *   Reports the misuse and aborts, so that a core dump shows the call
+ *   that found it.
+ */
+static void
+guard_fail(void *bp, const char *what)
+{
+
+	fprintf(stderr, "mm: %s of block %p\n", what, bp);
+	abort();
+}
+#endif
+
+/*
+ * The remaining routines are heap consistency checker routines.  Each
+ * returns the number of errors that it prints.
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of a block.
+ *
+ * Effects:
+ *   Perform a minimal check on the block "bp".
+ */
+static int
+checkblock(void *bp)
+{
+	int errors = 0;
+
+	if ((uintptr_t)bp % DSIZE) {
+		printf("Error: %p is not doubleword aligned\n", bp);
+		errors++;
+	}
+	if (!GET_ALLOC(HDRP(bp)) && GET(HDRP(bp)) != GET(FTRP(bp))) {
+		printf("Error: %p header does not match footer\n", bp);
+		errors++;
+	}
+	if (GET_SIZE(HDRP(bp)) > 0 &&
+	    !GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp))) {
+		printf("Error: %p next block has the wrong prev-alloc bit\n", bp);
+		errors++;
+	}
+	if (!GET_ALLOC(HDRP(bp)) && !GET_PREV_ALLOC(HDRP(bp))) {
+		printf("Error: %p and the block before it are both free\n", bp);
+		errors++;
+	}
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar", whose heap is laid out.
+ *
+ * Effects:
+ *   Checks the arena's heap at "level", one of the MM_CHECK_* levels:
+ *   walks its blocks from the prologue to the epilogue, then checks its
+ *   free lists, the zeros of its last free block, and its slabs.
+ */
+static int
+checkarena(struct arena *ar, int level)
 {
+	size_t free_bytes[NLISTS];
+	char *brk = mem_region_sbrk(ar->region, 0);
+	char *heap_listp = ar->heap_listp;
+	unsigned long nfree = 0;
+	size_t size;
 	void *bp;
+	int errors = 0;
+	int list;
 
-	if (verbose)
-		printf("Heap (%p):\n", heap_listp);
+	if (level >= MM_CHECK_PRINT)
+		printf("Heap %d (%p):\n", ar->region, heap_listp);
 
-	if (GET_SIZE(HDRP(heap_listp)) != WSIZE ||
-	    !GET_ALLOC(HDRP(heap_listp)))
+	if (GET_SIZE(HDRP(heap_listp)) != DSIZE ||
+	    !GET_ALLOC(HDRP(heap_listp))) {
 		printf("Bad prologue header\n");
-	checkblock(heap_listp);
+		errors++;
+	}
 
-	for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-		if (verbose)
+	memset(free_bytes, 0, sizeof(free_bytes));
+	for (bp = heap_listp; (size = GET_SIZE(HDRP(bp))) > 0;
+	    bp = NEXT_BLKP(bp)) {
+		if (level >= MM_CHECK_PRINT)
 			printblock(bp);
-		checkblock(bp);
+
+		/* A bad size would send the walk astray, so stop there. */
+		if ((char *)bp + size > brk) {
+			printf("Error: %p runs past the end of heap %d\n", bp,
+			    ar->region);
+			return (errors + 1);
+		}
+		if (bp != heap_listp && size < 2 * DSIZE) {
+			printf("Error: %p is smaller than the minimum block\n",
+			    bp);
+			errors++;
+		}
+		errors += checkblock(bp);
+		if (!GET_ALLOC(HDRP(bp))) {
+			free_bytes[find_list(size)] += size;
+			nfree++;
+		}
+	}
+	for (list = 0; list < NLISTS; list++) {
+		if (free_bytes[list] != ar->free_bytes[list]) {
+			printf("Error: free list %d holds %zu bytes, not %zu\n",
+			    list, free_bytes[list], ar->free_bytes[list]);
+			errors++;
+		}
 	}
 
-	if (verbose)
+	if (level >= MM_CHECK_PRINT)
 		printblock(bp);
-	if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
+	if (!GET_ALLOC(HDRP(bp)) || (char *)bp != brk) {
 		printf("Bad epilogue header\n");
+		errors++;
+	}
+
+	if (level >= MM_CHECK_LISTS) {
+		errors += checklists(ar, nfree);
+		if (!GET_PREV_ALLOC(HDRP(bp)))
+			errors += checkclean(ar, PREV_BLKP(bp));
+	}
+	return (errors + checkslabs(ar, level));
+}
+
+/*
+ * Requires:
+ *   "bp" is the free block that ends the heap of arena "ar".  The caller
+ *   holds the arena's lock.
+ *
+ * Effects:
+ *   Checks that the block reads zero from "ar->clean" on, but for its
+ *   links and footer, as mm_calloc assumes.
+ */
+static int
+checkclean(struct arena *ar, char *bp)
+{
+	char *p = MAX(ar->clean, bp + sizeof(struct free_block));
+
+	for (; p < FTRP(bp); p++) {
+		if (*p != 0) {
+			printf("Error: %p in the last free block %p is not "
+			    "zero\n", p, bp);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar", whose heap has "nfree" free
+ *   blocks.
+ *
+ * Effects:
+ *   Checks that every free block is in exactly one free list or the size
+ *   tree, the right one for its size, that the lists are doubly linked
+ *   and the bitmaps match them, and that every deferred free is an
+ *   allocated block on the quick list for its size.
+ */
+static int
+checklists(struct arena *ar, unsigned long nfree)
+{
+	struct free_block *current, *prev;
+	unsigned long listed = 0;
+	unsigned int nquick = 0;
+	bool bit;
+	int errors = 0;
+	int fl, list;
+
+	for (list = 0; list < NLISTS; list++) {
+		bit = ar->sl_bitmap[list >> SL_LOG2] &
+		    (1u << (list & (SL_COUNT - 1)));
+		if (bit != (ar->free_listp[list] != NULL)) {
+			printf("Error: bitmap bit of free list %d is wrong\n",
+			    list);
+			errors++;
+		}
+
+		/* Each listed block counts once, so a cycle ends the walk. */
+		prev = NULL;
+		for (current = ar->free_listp[list]; current != NULL;
+		    prev = current, current = current->next) {
+			if (++listed > nfree) {
+				printf("Error: free list %d is longer than the "
+				    "heap\n", list);
+				return (errors + 1);
+			}
+			if (current->prev != prev) {
+				printf("Error: %p prev link does not match its "
+				    "predecessor %p\n", current, prev);
+				errors++;
+			}
+			if (checkfree(ar, current, list) > 0)
+				return (errors + 1);
+		}
+	}
+	for (fl = 0; fl < FL_COUNT; fl++) {
+		if (!(ar->fl_bitmap & (1u << fl)) != !ar->sl_bitmap[fl]) {
+			printf("Error: bitmap bit of class %d is wrong\n", fl);
+			errors++;
+		}
+	}
+
+	if (ar->tree != NULL && ar->policy == MM_POLICY_LIFO) {
+		printf("Error: a LIFO arena has a size tree\n");
+		errors++;
+	}
+	errors += checktree(ar, ar->tree, NULL, NULL, &listed);
+	if (listed != nfree) {
+		printf("Error: heap %d has %lu free blocks, but %lu are "
+		    "listed\n", ar->region, nfree, listed);
+		errors++;
+	}
+
+	for (list = 0; list < NLISTS; list++) {
+		for (current = ar->quick[list]; current != NULL;
+		    current = current->next) {
+			if (++nquick > ar->nquick) {
+				printf("Error: quick list %d is too long\n",
+				    list);
+				return (errors + 1);
+			}
+			if (mem_region_of(current) != ar->region ||
+			    !GET_ALLOC(HDRP(current)) ||
+			    find_list(GET_SIZE(HDRP(current))) != list) {
+				printf("Error: %p does not belong on quick list "
+				    "%d\n", current, list);
+				errors++;
+			}
+		}
+	}
+	if (nquick != ar->nquick) {
+		printf("Error: heap %d defers %u frees, not %u\n", ar->region,
+		    nquick, ar->nquick);
+		errors++;
+	}
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".  "bp" was found on free list
+ *   "list", or in the size tree if "list" is -1.
+ *
+ * Effects:
+ *   Checks that "bp" is a free block of the arena that belongs there.
+ */
+static int
+checkfree(struct arena *ar, void *bp, int list)
+{
+	size_t size;
+	bool tree;
+
+	if (mem_region_of(bp) != ar->region || (char *)bp < ar->heap_listp ||
+	    (char *)bp >= (char *)mem_region_sbrk(ar->region, 0)) {
+		printf("Error: %p is listed but outside heap %d\n", bp,
+		    ar->region);
+		return (1);
+	}
+	if (GET_ALLOC(HDRP(bp))) {
+		printf("Error: %p is listed but allocated\n", bp);
+		return (1);
+	}
+	size = GET_SIZE(HDRP(bp));
+	tree = ar->policy != MM_POLICY_LIFO && size >= TREE_MIN;
+	if (list >= 0 ? tree || find_list(size) != list : !tree) {
+		printf("Error: %p of %zu bytes is in the wrong free list\n", bp,
+		    size);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".  "t" is a subtree of its
+ *   size tree, whose nodes must all order between "lo" and "hi", where
+ *   NULL is unbounded.
+ *
+ * Effects:
+ *   Checks the order and priorities of the subtree and each of its nodes,
+ *   and adds the number of nodes to "count".
+ */
+static int
+checktree(struct arena *ar, struct tree_block *t, struct tree_block *lo,
+    struct tree_block *hi, unsigned long *count)
+{
+	int errors = 0;
+
+	for (; t != NULL; t = t->right) {
+		(*count)++;
+		if (checkfree(ar, t, -1) > 0)
+			return (errors + 1);
+		if ((lo != NULL && !TREE_LESS(lo, t)) ||
+		    (hi != NULL && !TREE_LESS(t, hi))) {
+			printf("Error: %p is out of order in the size tree\n",
+			    t);
+			return (errors + 1);
+		}
+		if ((t->left != NULL && TREE_PRIO(t->left) > TREE_PRIO(t)) ||
+		    (t->right != NULL && TREE_PRIO(t->right) > TREE_PRIO(t))) {
+			printf("Error: %p is outranked by a child\n", t);
+			errors++;
+		}
+		errors += checktree(ar, t->left, lo, t, count);
+		lo = t;
+	}
+	return (errors);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock of arena "ar".
+ *
+ * Effects:
+ *   Checks that each partial slab is in the arena and on the list of its
+ *   class.  Above MM_CHECK_BLOCKS, also checks the links of the partial
+ *   and unused slabs and that their bitmaps match their free counts.
+ */
+static int
+checkslabs(struct arena *ar, int level)
+{
+	struct slab *slab, *prev;
+	struct slab **listp;
+	unsigned int nfree;
+	int errors = 0;
+	int c, w;
+
+	for (c = 0; c <= SLAB_CLASSES; c++) {
+		listp = (c < SLAB_CLASSES) ? &ar->partial[c] : &ar->empty;
+		prev = NULL;
+		for (slab = *listp; slab != NULL; prev = slab,
+		    slab = slab->next) {
+			if (ARENA_OF(slab) != ar || !IS_SLAB(slab)) {
+				printf("Error: slab %p is in the wrong arena\n",
+				    slab);
+				return (errors + 1);
+			}
+			if (c < SLAB_CLASSES && (SLAB_CLASS(slab->size) != c ||
+			    slab->nfree == 0)) {
+				printf("Error: slab %p is on the wrong partial "
+				    "list\n", slab);
+				errors++;
+			}
+			if (level < MM_CHECK_LISTS)
+				continue;
+			if (slab->prev != prev) {
+				printf("Error: slab %p prev link does not match "
+				    "its predecessor\n", slab);
+				errors++;
+			}
+			nfree = 0;
+			for (w = 0; w < SLAB_MAPWORDS; w++)
+				nfree += __builtin_popcountll(~slab->map[w]);
+			if (nfree != slab->nfree ||
+			    (c == SLAB_CLASSES && nfree != slab->nslots)) {
+				printf("Error: slab %p has %u free slots, not "
+				    "%u\n", slab, nfree, slab->nfree);
+				errors++;
+			}
+		}
+	}
+	return (errors);
 }
 
 /*
@@ -617,23 +3460,26 @@ checkheap(bool verbose)
  *   Print the block "bp".
  */
 static void
-printblock(void *bp) 
+printblock(void *bp)
 {
 	size_t hsize, fsize;
 	bool halloc, falloc;
 
-	checkheap(false);
 	hsize = GET_SIZE(HDRP(bp));
-	halloc = GET_ALLOC(HDRP(bp));  
-	fsize = GET_SIZE(FTRP(bp));
-	falloc = GET_ALLOC(FTRP(bp));  
+	halloc = GET_ALLOC(HDRP(bp));
 
 	if (hsize == 0) {
 		printf("%p: end of heap\n", bp);
 		return;
 	}
+	if (halloc) {
+		printf("%p: header: [%zu:a]\n", bp, hsize);
+		return;
+	}
 
-	printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp, 
-	    hsize, (halloc ? 'a' : 'f'), 
+	fsize = GET_SIZE(FTRP(bp));
+	falloc = GET_ALLOC(FTRP(bp));
+	printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp,
+	    hsize, (halloc ? 'a' : 'f'),
 	    fsize, (falloc ? 'a' : 'f'));
-}
\ No newline at end of file
+}
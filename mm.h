@@ -4,8 +4,96 @@
 
 int	 mm_init(void);
 void	*mm_malloc(size_t size);
+void	*mm_calloc(size_t nmemb, size_t size);
 void	 mm_free(void *ptr);
 void	*mm_realloc(void *ptr, size_t size);
+void	*mm_memalign(size_t alignment, size_t size);
+void	*mm_aligned_alloc(size_t alignment, size_t size);
+void	*mm_malloc_node(size_t size, int node);
+size_t	 mm_malloc_batch(size_t size, size_t n, void **out);
+void	 mm_free_batch(void **ptrs, size_t n);
+size_t	 mm_usable_size(void *ptr);
+int	 mm_setopt(int opt, size_t value);
+int	 mm_trim(size_t pad);
+
+/*
+ * Statistics, from mm_getstats.  All but the heap size and peak count from
+ * the last mm_init.  Sizes are in bytes and include block overhead.
+ */
+#define	MM_STATS_LISTS	160	/* Free lists, the classes of find_list. */
+
+struct mm_stats {
+	size_t	heap_size;	/* Memory held from memlib. */
+	size_t	heap_peak;	/* Largest heap_size since the last reset. */
+	size_t	in_use;		/* Blocks held by the application. */
+	size_t	free_bytes;	/* Free heap blocks. */
+	size_t	free_list[MM_STATS_LISTS]; /* Free heap blocks, by class. */
+	unsigned long nmalloc;	/* Blocks allocated, by any routine. */
+	unsigned long nfree;	/* Blocks freed, by any routine. */
+	unsigned long nrealloc;	/* Calls of mm_realloc. */
+	unsigned long nrealloc_inplace; /* Of those, ones that kept the block. */
+	unsigned long nextend;	/* Heap extensions. */
+	unsigned long nfit;	/* Free list searches. */
+	unsigned long nprobe;	/* Free blocks those searches examined. */
+	double	probe_avg;	/* nprobe / nfit. */
+};
+
+void	 mm_getstats(struct mm_stats *st);
+
+/*
+ * The heap profiler, on when MM_OPT_PROF_RATE is nonzero, writes the call
+ * stacks of sampled live blocks as a pprof heap profile.
+ */
+int	 mm_prof_dump(const char *path);
+
+/*
+ * The heap checker.  mm_checkheap prints each inconsistency that it finds
+ * and returns their number, so 0 means that the heap is consistent.
+ */
+#define	MM_CHECK_BLOCKS	0	/* Walk every block of every heap. */
+#define	MM_CHECK_LISTS	1	/* Also check the free lists, trees and slabs. */
+#define	MM_CHECK_PRINT	2	/* Also print every block. */
+
+int	 mm_checkheap(int level);
+
+/*
+ * Fork handlers, for pthread_atfork: mm_prefork takes every lock of the
+ * allocator and mm_postfork releases them, in the parent and the child.
+ */
+void	 mm_prefork(void);
+void	 mm_postfork(void);
+
+/*
+ * Scoped arenas, in mmarena.c: bump allocation from chunks of mm_malloc'd
+ * memory, all of which is released at once by mm_arena_reset or
+ * mm_arena_destroy.
+ */
+typedef struct mm_arena mm_arena_t;
+
+mm_arena_t	*mm_arena_create(size_t chunksize);
+void		*mm_arena_alloc(mm_arena_t *a, size_t size);
+void		 mm_arena_reset(mm_arena_t *a);
+void		 mm_arena_destroy(mm_arena_t *a);
+
+/*
+ * Tunables for mm_setopt.
+ */
+#define	MM_OPT_GROW_MIN	1	/* Smallest heap extension (bytes). */
+#define	MM_OPT_GROW_MAX	2	/* Largest geometric heap extension (bytes). */
+#define	MM_OPT_MMAP_THRESHOLD 3	/* Larger requests get their own mapping. */
+#define	MM_OPT_TRIM_THRESHOLD 4	/* Larger free blocks are given back. */
+#define	MM_OPT_POLICY	5	/* Placement policy, one of MM_POLICY_*. */
+#define	MM_OPT_BEST_FIT_SCAN 6	/* Fits that MM_POLICY_BEST compares. */
+#define	MM_OPT_DEFER	7	/* Frees deferred before coalescing; 0 is off. */
+#define	MM_OPT_PROF_RATE 8	/* Mean bytes between profile samples; 0 is off. */
+
+/*
+ * Placement policies for MM_OPT_POLICY.  All but LIFO keep large free
+ * blocks in a size tree, so that they are always placed by best fit.
+ */
+#define	MM_POLICY_LIFO	0	/* LIFO free lists, first fit (default). */
+#define	MM_POLICY_ADDRESS 1	/* Address-ordered free lists, first fit. */
+#define	MM_POLICY_BEST	2	/* LIFO free lists, bounded best fit. */
 
 /*
  * Students work in teams of one or two.  Teams enter their team name, personal
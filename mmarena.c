@@ -0,0 +1,202 @@
+/*
+ * Scoped arenas layered on the malloc package in mm.c.
+ *
+ * An arena hands out memory with a bump pointer from chunks that it gets
+ * from mm_malloc, and it never frees individual allocations: everything
+ * allocated from an arena dies together when the arena is reset or
+ * destroyed, which costs one mm_free per chunk.  This suits memory whose
+ * lifetime is a request, a phase or a pass.  Arenas are not thread safe.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mm.h"
+
+/* Basic constants: */
+#define ARENA_ALIGN  (2 * sizeof(void *))   /* Same alignment as mm_malloc */
+#define ARENA_CHUNK  (64 * 1024)            /* Default chunk size (bytes) */
+
+/* Round up to a multiple of ARENA_ALIGN. */
+#define ALIGN_UP(size)  (((size) + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1))
+
+/*
+ * A chunk:
+ *
+ *  The header of a block from mm_malloc that an arena allocates from.
+ *  The usable bytes follow the header.
+ */
+struct mm_chunk {
+	struct mm_chunk *next;  /* Next older chunk of the same arena */
+	size_t size;            /* Number of usable bytes */
+};
+
+#define CHUNK_HDR      ALIGN_UP(sizeof(struct mm_chunk))
+#define CHUNK_START(c) ((char *)(c) + CHUNK_HDR)
+
+/*
+ * An arena:
+ *
+ *  Allocates from the free part, "bump" to "limit", of its newest chunk.
+ */
+struct mm_arena {
+	struct mm_chunk *chunks; /* Newest chunk, or NULL */
+	char *bump;              /* Next free byte of the newest chunk */
+	char *limit;             /* End of the newest chunk */
+	size_t chunksize;        /* Usable bytes in a regular chunk */
+};
+
+/* Function prototypes for internal helper routines: */
+static struct mm_chunk *chunk_alloc(size_t size);
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Creates an empty arena whose chunks hold "chunksize" bytes, or a
+ *   default amount if "chunksize" is zero.  Returns the arena, or NULL if
+ *   there is not enough memory.
+ */
+mm_arena_t *
+mm_arena_create(size_t chunksize)
+{
+	mm_arena_t *a;
+
+	if ((a = mm_malloc(sizeof(*a))) == NULL)
+		return (NULL);
+	a->chunks = NULL;
+	a->bump = a->limit = NULL;
+	a->chunksize = ALIGN_UP(chunksize == 0 ? ARENA_CHUNK : chunksize);
+	return (a);
+}
+
+/*
+ * Requires:
+ *   "a" is an arena.
+ *
+ * Effects:
+ *   Allocates "size" bytes from the arena, aligned like mm_malloc's
+ *   blocks.  Returns their address, or NULL if "size" is zero or there is
+ *   not enough memory.
+ */
+void *
+mm_arena_alloc(mm_arena_t *a, size_t size)
+{
+	struct mm_chunk *chunk;
+	void *p;
+
+	if (size == 0 || size > SIZE_MAX - CHUNK_HDR - ARENA_ALIGN)
+		return (NULL);
+	size = ALIGN_UP(size);
+
+	/* The common case: bump the pointer. */
+	if (size <= (size_t)(a->limit - a->bump)) {
+		p = a->bump;
+		a->bump += size;
+		return (p);
+	}
+
+	/*
+	 * A request of more than a quarter chunk gets a chunk of its own,
+	 * linked behind the newest one so that the bump pointer's chunk keeps
+	 * its free space.
+	 */
+	if (size > a->chunksize / 4) {
+		if ((chunk = chunk_alloc(size)) == NULL)
+			return (NULL);
+		if (a->chunks != NULL) {
+			chunk->next = a->chunks->next;
+			a->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			a->chunks = chunk;
+			a->bump = a->limit = CHUNK_START(chunk) + size;
+		}
+		return (CHUNK_START(chunk));
+	}
+
+	/* Start a new chunk. */
+	if ((chunk = chunk_alloc(a->chunksize)) == NULL)
+		return (NULL);
+	chunk->next = a->chunks;
+	a->chunks = chunk;
+	a->bump = CHUNK_START(chunk) + size;
+	a->limit = CHUNK_START(chunk) + chunk->size;
+	return (CHUNK_START(chunk));
+}
+
+/*
+ * Requires:
+ *   "a" is an arena.
+ *
+ * Effects:
+ *   Frees everything allocated from the arena.  The newest regular chunk
+ *   is kept for the allocations that follow, and every other chunk is
+ *   returned to mm_free.
+ */
+void
+mm_arena_reset(mm_arena_t *a)
+{
+	struct mm_chunk *chunk, *next;
+	struct mm_chunk *keep = NULL;
+
+	for (chunk = a->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (keep == NULL && chunk->size == a->chunksize)
+			keep = chunk;
+		else
+			mm_free(chunk);
+	}
+	a->chunks = keep;
+	if (keep != NULL) {
+		keep->next = NULL;
+		a->bump = CHUNK_START(keep);
+		a->limit = CHUNK_START(keep) + keep->size;
+	} else
+		a->bump = a->limit = NULL;
+}
+
+/*
+ * Requires:
+ *   "a" is an arena or NULL.
+ *
+ * Effects:
+ *   Frees everything allocated from the arena, and the arena itself.
+ */
+void
+mm_arena_destroy(mm_arena_t *a)
+{
+	struct mm_chunk *chunk, *next;
+
+	if (a == NULL)
+		return;
+	for (chunk = a->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		mm_free(chunk);
+	}
+	mm_free(a);
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   "size" is a multiple of ARENA_ALIGN.
+ *
+ * Effects:
+ *   Allocates a chunk with "size" usable bytes from mm_malloc.  Returns
+ *   the chunk, with no successor, or NULL if there is not enough memory.
+ */
+static struct mm_chunk *
+chunk_alloc(size_t size)
+{
+	struct mm_chunk *chunk;
+
+	if ((chunk = mm_malloc(CHUNK_HDR + size)) == NULL)
+		return (NULL);
+	chunk->next = NULL;
+	chunk->size = size;
+	return (chunk);
+}
@@ -0,0 +1,448 @@
+/*
+ * A sampling heap profiler for the malloc package in mm.c.
+ *
+ * mm.c samples about one allocation in every "rate" bytes allocated,
+ * drawing the gaps between samples from an exponential distribution so
+ * that the samples form a Poisson process over the bytes.  This module
+ * records the call stack of each sampled block and forgets the block
+ * when it is freed.  Samples with the same stack share a bucket, which
+ * also counts every sample ever taken there, and prof_dump writes the
+ * buckets out as a pprof heap profile in the "heap_v2" format, which
+ * pprof scales back up by the sampling rate.
+ *
+ * The records live in memory mapped straight from the system, so the
+ * profiler never calls back into the allocator that it watches while it
+ * holds its lock.  One lock protects them all; only sampled allocations
+ * and the frees of blocks that hash to a slot in use ever take it.
+ * prof_dump copies the buckets out under the lock and leaves stdio, which
+ * allocates, until it has released it.
+ */
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mmprof.h"
+
+/* Basic constants: */
+#define PROF_DEPTH    32          /* Deepest call stack recorded */
+#define PROF_SKIP     1           /* Frames of prof_sample itself */
+#define PROF_BUCKETS  (1 << 12)   /* Slots of the bucket table */
+#define PROF_CHUNK    (64 * 1024) /* Bytes of records mapped at a time */
+#define PROF_ALIGN    16          /* Alignment of records (bytes) */
+
+/*
+ * A bucket:
+ *
+ *  The samples taken at one call stack.
+ */
+struct prof_bucket {
+	struct prof_bucket *next;   /* Next bucket in the same slot */
+	uintptr_t hash;             /* Hash of the call stack */
+	int depth;                  /* Number of frames in "pcs" */
+	void *pcs[PROF_DEPTH];      /* Return addresses, innermost first */
+	size_t live_count;          /* Samples whose blocks are live */
+	size_t live_bytes;          /* Bytes of those blocks */
+	size_t total_count;         /* Samples ever taken */
+	size_t total_bytes;         /* Bytes of those blocks */
+};
+
+/*
+ * A sample:
+ *
+ *  A live sampled block, in the slot of prof_samples that its address
+ *  hashes to.
+ */
+struct prof_sample {
+	struct prof_sample *next;   /* Next sample in the same slot */
+	void *bp;                   /* Address of the block */
+	size_t size;                /* Size of the block */
+	struct prof_bucket *bucket; /* Bucket of its call stack */
+};
+
+/* Global variables: */
+struct prof_sample *prof_samples[1 << PROF_SLOTS_LOG2];
+
+static struct prof_bucket *prof_buckets[PROF_BUCKETS];
+static struct prof_sample *prof_spare;  /* Records of forgotten samples */
+static char *prof_bump;                 /* Next free byte of the chunk */
+static char *prof_limit;                /* End of the chunk */
+static size_t prof_live;                /* Samples in prof_samples */
+static size_t prof_nbuckets;            /* Buckets in prof_buckets */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Function prototypes for internal helper routines: */
+static void *prof_alloc(size_t size);
+static struct prof_bucket *prof_bucket(void **pcs, int depth);
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Readies the profiler to take samples.  Unwinding the stack the first
+ *   time may load and allocate for the unwinder, so do that now rather
+ *   than from inside the allocator.
+ */
+void
+prof_init(void)
+{
+	void *pc;
+
+	backtrace(&pc, 1);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block of "size" bytes that was just
+ *   allocated.
+ *
+ * Effects:
+ *   Records the block as a sample, with the caller's call stack.  Drops
+ *   the sample if there is no memory for the records.
+ */
+void
+prof_sample(void *bp, size_t size)
+{
+	void *pcs[PROF_DEPTH + PROF_SKIP];
+	struct prof_bucket *bucket;
+	struct prof_sample *sample;
+	size_t slot = PROF_SLOT(bp);
+	int depth;
+
+	/* Unwind before locking: it is the slow part. */
+	depth = backtrace(pcs, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+	if (depth < 0)
+		depth = 0;
+
+	pthread_mutex_lock(&prof_lock);
+	if ((bucket = prof_bucket(pcs + PROF_SKIP, depth)) == NULL)
+		goto out;
+	if ((sample = prof_spare) != NULL)
+		prof_spare = sample->next;
+	else if ((sample = prof_alloc(sizeof(*sample))) == NULL)
+		goto out;
+	sample->bp = bp;
+	sample->size = size;
+	sample->bucket = bucket;
+	bucket->live_count++;
+	bucket->live_bytes += size;
+	bucket->total_count++;
+	bucket->total_bytes += size;
+	prof_live++;
+
+	/* Publish the sample only once it is complete. */
+	sample->next = prof_samples[slot];
+	__atomic_store_n(&prof_samples[slot], sample, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a block that is being freed.
+ *
+ * Effects:
+ *   Forgets the block's sample, if it has one.
+ */
+void
+prof_free(void *bp)
+{
+	struct prof_sample **linkp;
+	struct prof_sample *sample;
+
+	pthread_mutex_lock(&prof_lock);
+	for (linkp = &prof_samples[PROF_SLOT(bp)]; (sample = *linkp) != NULL;
+	    linkp = &sample->next) {
+		if (sample->bp == bp) {
+			__atomic_store_n(linkp, sample->next, __ATOMIC_RELAXED);
+			sample->bucket->live_count--;
+			sample->bucket->live_bytes -= sample->size;
+			sample->next = prof_spare;
+			prof_spare = sample;
+			prof_live--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   "old" is the address of a block that was just resized, in place or
+ *   not, to the block "bp" of "size" bytes.
+ *
+ * Effects:
+ *   Moves the block's sample, if it has one, to "bp" and updates its size.
+ *   The sample keeps the call stack of the original allocation.  A block
+ *   that another thread placed at "old" once it was released was sampled
+ *   later, so the oldest sample at "old" is the one that moves.
+ */
+void
+prof_realloc(void *old, void *bp, size_t size)
+{
+	struct prof_sample **linkp, **found = NULL;
+	struct prof_sample *sample;
+	size_t slot = PROF_SLOT(bp);
+
+	pthread_mutex_lock(&prof_lock);
+	for (linkp = &prof_samples[PROF_SLOT(old)]; (sample = *linkp) != NULL;
+	    linkp = &sample->next) {
+		if (sample->bp == old)
+			found = linkp;
+	}
+	if (found != NULL) {
+		sample = *found;
+		sample->bucket->live_bytes += size - sample->size;
+		sample->size = size;
+		if (bp != old) {
+			__atomic_store_n(found, sample->next, __ATOMIC_RELAXED);
+			sample->bp = bp;
+			sample->next = prof_samples[slot];
+			__atomic_store_n(&prof_samples[slot], sample,
+			    __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Forgets every live sample, as the heap that held them is gone.  The
+ *   buckets keep their totals.
+ */
+void
+prof_reset(void)
+{
+	struct prof_bucket *bucket;
+	struct prof_sample *sample;
+	size_t i;
+
+	/* Most heaps were never sampled: skip the scan of every slot. */
+	pthread_mutex_lock(&prof_lock);
+	if (prof_live == 0) {
+		pthread_mutex_unlock(&prof_lock);
+		return;
+	}
+	for (i = 0; i < (size_t)1 << PROF_SLOTS_LOG2; i++) {
+		while ((sample = prof_samples[i]) != NULL) {
+			__atomic_store_n(&prof_samples[i], sample->next,
+			    __ATOMIC_RELAXED);
+			sample->next = prof_spare;
+			prof_spare = sample;
+		}
+	}
+	for (i = 0; i < PROF_BUCKETS; i++) {
+		for (bucket = prof_buckets[i]; bucket != NULL;
+		    bucket = bucket->next)
+			bucket->live_count = bucket->live_bytes = 0;
+	}
+	prof_live = 0;
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   "rate" is greater than zero and "seed" points to a thread's random
+ *   state, which is nonzero.
+ *
+ * Effects:
+ *   Returns the number of bytes to allocate before taking the next
+ *   sample: a draw from the exponential distribution with mean "rate".
+ */
+size_t
+prof_interval(size_t rate, uint64_t *seed)
+{
+	uint64_t x = *seed;
+	double u, gap;
+
+	/* xorshift64*, whose top 53 bits give u in (0, 1]. */
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*seed = x;
+	u = (double)(((x * 0x2545f4914f6cdd1dULL) >> 11) + 1) / 9007199254740992.0;
+	gap = -log(u) * (double)rate;
+	return (gap < (double)((size_t)1 << 62) ? (size_t)gap + 1 :
+	    (size_t)1 << 62);
+}
+
+/*
+ * Requires:
+ *   "rate" is the mean number of bytes between samples.
+ *
+ * Effects:
+ *   Writes a pprof heap profile of the live samples, and of every sample
+ *   taken, to the file "path", followed by the process's memory map so
+ *   that pprof can symbolize it.  Returns 0 on success and -1 otherwise.
+ */
+int
+prof_dump(const char *path, size_t rate)
+{
+	struct prof_bucket *bucket, *copies = NULL;
+	size_t live_count = 0, live_bytes = 0;
+	size_t total_count = 0, total_bytes = 0;
+	size_t copies_size = 0, nbuckets = 0;
+	FILE *fp, *maps;
+	char line[4096];
+	size_t k, n;
+	int i, j, err;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return (-1);
+
+	/*
+	 * Copy the buckets and format the copies once the lock is released:
+	 * stdio allocates, and a sampled allocation takes the lock.
+	 */
+	pthread_mutex_lock(&prof_lock);
+	if (prof_nbuckets > 0) {
+		copies_size = prof_nbuckets * sizeof(*copies);
+		copies = mmap(NULL, copies_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (copies == MAP_FAILED) {
+			pthread_mutex_unlock(&prof_lock);
+			fclose(fp);
+			return (-1);
+		}
+		for (i = 0; i < PROF_BUCKETS; i++) {
+			for (bucket = prof_buckets[i]; bucket != NULL;
+			    bucket = bucket->next)
+				copies[nbuckets++] = *bucket;
+		}
+	}
+	pthread_mutex_unlock(&prof_lock);
+
+	for (k = 0; k < nbuckets; k++) {
+		live_count += copies[k].live_count;
+		live_bytes += copies[k].live_bytes;
+		total_count += copies[k].total_count;
+		total_bytes += copies[k].total_bytes;
+	}
+	fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+	    live_count, live_bytes, total_count, total_bytes, rate);
+	for (k = 0; k < nbuckets; k++) {
+		bucket = &copies[k];
+		fprintf(fp, "%zu: %zu [%zu: %zu] @", bucket->live_count,
+		    bucket->live_bytes, bucket->total_count,
+		    bucket->total_bytes);
+		for (j = 0; j < bucket->depth; j++)
+			fprintf(fp, " %p", bucket->pcs[j]);
+		fputc('\n', fp);
+	}
+	if (copies != NULL)
+		munmap(copies, copies_size);
+
+	fputs("\nMAPPED_LIBRARIES:\n", fp);
+	if ((maps = fopen("/proc/self/maps", "r")) != NULL) {
+		while ((n = fread(line, 1, sizeof(line), maps)) > 0)
+			fwrite(line, 1, n, fp);
+		fclose(maps);
+	}
+	err = ferror(fp);
+	if (fclose(fp) != 0 || err)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Takes the profiler's lock before a fork.  prof_postfork releases it.
+ */
+void
+prof_prefork(void)
+{
+
+	pthread_mutex_lock(&prof_lock);
+}
+
+/*
+ * Requires:
+ *   The caller holds the lock taken by prof_prefork.
+ *
+ * Effects:
+ *   Releases it, in the parent or in the child after a fork.
+ */
+void
+prof_postfork(void)
+{
+
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   The caller holds prof_lock.
+ *
+ * Effects:
+ *   Allocates "size" bytes for a record from the system.  Returns their
+ *   address, or NULL if the system is out of memory.
+ */
+static void *
+prof_alloc(size_t size)
+{
+	void *p;
+
+	size = (size + PROF_ALIGN - 1) & ~(size_t)(PROF_ALIGN - 1);
+	if (prof_bump == NULL || size > (size_t)(prof_limit - prof_bump)) {
+		p = mmap(NULL, PROF_CHUNK, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return (NULL);
+		prof_bump = p;
+		prof_limit = prof_bump + PROF_CHUNK;
+	}
+	p = prof_bump;
+	prof_bump += size;
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "pcs" holds "depth" return addresses.  The caller holds prof_lock.
+ *
+ * Effects:
+ *   Returns the bucket of the call stack "pcs", creating it if need be,
+ *   or NULL if the system is out of memory.
+ */
+static struct prof_bucket *
+prof_bucket(void **pcs, int depth)
+{
+	struct prof_bucket **slotp;
+	struct prof_bucket *bucket;
+	uintptr_t hash = (uintptr_t)depth;
+	int i;
+
+	for (i = 0; i < depth; i++)
+		hash = (hash ^ (uintptr_t)pcs[i]) * (uintptr_t)0x100000001b3ULL;
+	slotp = &prof_buckets[hash % PROF_BUCKETS];
+	for (bucket = *slotp; bucket != NULL; bucket = bucket->next) {
+		if (bucket->hash == hash && bucket->depth == depth &&
+		    memcmp(bucket->pcs, pcs, depth * sizeof(*pcs)) == 0)
+			return (bucket);
+	}
+
+	if ((bucket = prof_alloc(sizeof(*bucket))) == NULL)
+		return (NULL);
+	memset(bucket, 0, sizeof(*bucket));
+	bucket->hash = hash;
+	bucket->depth = depth;
+	memcpy(bucket->pcs, pcs, depth * sizeof(*pcs));
+	bucket->next = *slotp;
+	*slotp = bucket;
+	prof_nbuckets++;
+	return (bucket);
+}
@@ -0,0 +1,32 @@
+/*
+ * The interface between mm.c and the heap profiler in mmprof.c.
+ *
+ * mm.c decides which allocations to sample and calls prof_sample for
+ * them.  Every sampled block that is still live hangs off one slot of
+ * prof_samples, found by hashing its address, so mm_free needs to call
+ * prof_free only when the block's slot is in use, and mm_realloc needs to
+ * call prof_realloc only when the old block's slot is.
+ */
+
+#define PROF_SLOTS_LOG2  16  /* log2 of the number of sample slots */
+
+/* Find the sample slot of a block address. */
+#define PROF_SLOT(bp)  \
+	((size_t)(((uintptr_t)(bp) * (uintptr_t)0x9e3779b97f4a7c15ULL) >> \
+	    (8 * sizeof(uintptr_t) - PROF_SLOTS_LOG2)))
+
+/* True if block "bp" may have been sampled, so that it needs prof_free. */
+#define PROF_MAYBE_SAMPLED(bp)  \
+	(__atomic_load_n(&prof_samples[PROF_SLOT(bp)], __ATOMIC_RELAXED) != NULL)
+
+extern struct prof_sample *prof_samples[1 << PROF_SLOTS_LOG2];
+
+void	 prof_init(void);
+void	 prof_sample(void *bp, size_t size);
+void	 prof_free(void *bp);
+void	 prof_realloc(void *old, void *bp, size_t size);
+void	 prof_reset(void);
+size_t	 prof_interval(size_t rate, uint64_t *seed);
+int	 prof_dump(const char *path, size_t rate);
+void	 prof_prefork(void);
+void	 prof_postfork(void);
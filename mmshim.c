@@ -0,0 +1,881 @@
+/*
+ * A drop-in replacement for the C library's malloc, built on the malloc
+ * package in mm.c.
+ *
+ * Built as libmm.so, this module exports malloc, free, realloc, calloc,
+ * posix_memalign and their relatives, so that "LD_PRELOAD=./libmm.so prog"
+ * runs a dynamically linked program on mm.c, with memlib.c handing out
+ * real memory.  The package starts itself on the first call.  The few
+ * calls that the C library makes while it starts are served from a static
+ * buffer that is never reused.
+ *
+ * If the environment variable MM_TRACE names a file when the package
+ * starts, every call is also recorded there as a binary trace (tracefmt.h)
+ * that mdriver replays with -f.  The id of a freed block is reused, so the
+ * trace needs only as many ids as the process ever had live blocks.  One
+ * lock orders the records: an allocation is recorded after it happens and
+ * a free before, so the trace never shows an address handed out twice.
+ * Thread ops mark which thread made the requests, so mdriver -T can
+ * replay them on as many threads.  Aligned allocations are recorded as
+ * plain ones, as traces carry no alignment.  The header is rewritten each
+ * time the records are flushed, so the trace stays whole, if short, when
+ * the process dies or execs.  A child made by fork stops recording.
+ * Unless the file name holds a "%p", which becomes the process id,
+ * MM_TRACE is removed from the environment so that programs that the
+ * process runs do not overwrite the trace.  The recorder's tables live in
+ * memory mapped straight from the system.
+ */
+#define _GNU_SOURCE /* for mremap */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+#include "tracefmt.h"
+
+/* Basic constants: */
+#define BOOT_SIZE     (64 * 1024)  /* Bytes of the startup buffer */
+#define BOOT_ALIGN    16           /* Alignment of startup blocks (bytes) */
+#define REC_BUFSIZE   (64 * 1024)  /* Bytes of records written at a time */
+#define REC_SLOTS     (1 << 16)    /* Initial slots of the address table */
+
+/* True if "p" is a block from the startup buffer. */
+#define IS_BOOT(p)  \
+	((char *)(p) >= boot_buf && (char *)(p) < boot_buf + BOOT_SIZE)
+
+/* True if calls may need recording; rec_lock must be taken to be sure. */
+#define RECORDING()  (__atomic_load_n(&rec_fd, __ATOMIC_RELAXED) >= 0)
+
+/*
+ * A slot of the address table:
+ *
+ *  Maps the address of a live block to its id in the trace, or is empty
+ *  if "ptr" is NULL.
+ */
+struct rec_slot {
+	void *ptr;                  /* Address of the block */
+	uint32_t id;                /* Its id */
+};
+
+/* Global variables: */
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(BOOT_ALIGN)));
+static size_t boot_used;        /* Bytes of boot_buf handed out */
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static bool shim_ready;         /* True once the package has started */
+static __thread bool shim_starting; /* True while this thread starts it */
+
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rec_fd = -1;         /* The trace, or -1 if not recording */
+static unsigned char rec_buf[REC_BUFSIZE]; /* Records not yet written */
+static size_t rec_len;          /* Bytes in rec_buf */
+static uint64_t rec_nops;       /* Requests recorded */
+static uint32_t rec_nids;       /* Ids ever used */
+static struct rec_slot *rec_table; /* Address table, open addressed */
+static size_t rec_nslots;       /* Slots of rec_table, a power of two */
+static size_t rec_nlive;        /* Slots of rec_table in use */
+static uint32_t *rec_spare;     /* Ids of freed blocks, a stack */
+static size_t rec_nspare;       /* Ids on rec_spare */
+static size_t rec_maxspare;     /* Room on rec_spare */
+static uint32_t rec_nthreads;   /* Threads that have made requests */
+static uint32_t rec_thread;     /* Thread of the last request recorded */
+static __thread uint32_t rec_self; /* 1 + this thread's number, or 0 */
+
+/* Function prototypes for internal helper routines: */
+static bool shim_start(void);
+static void shim_init(void);
+static void *shim_malloc(size_t size);
+static void *shim_memalign(size_t alignment, size_t size);
+static void *shim_done(void *p, size_t size);
+static void shim_prefork(void);
+static void shim_postfork_parent(void);
+static void shim_postfork_child(void);
+static void *boot_alloc(size_t size);
+static bool rec_start(const char *path);
+static void rec_alloc(void *p, size_t size);
+static void rec_free(void *p);
+static void rec_realloc(void *oldp, void *newp, size_t size);
+static void rec_put(int type, uint32_t id, size_t size);
+static int rec_flush(void);
+static void rec_stop(const char *why);
+static int rec_insert(void *p, uint32_t id);
+static bool rec_remove(void *p, uint32_t *id);
+static size_t rec_home(void *p, size_t nslots);
+static void rec_exit(void) __attribute__((destructor));
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   The C library's malloc, from mm_malloc.  A request for zero bytes
+ *   gets a block of its own, as programs expect.
+ */
+void *
+malloc(size_t size)
+{
+
+	return (shim_malloc(size));
+}
+
+/*
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   The C library's free, from mm_free.  Blocks from the startup buffer
+ *   are not reused.
+ */
+void
+free(void *ptr)
+{
+
+	if (ptr == NULL || IS_BOOT(ptr))
+		return;
+	if (RECORDING()) {
+		pthread_mutex_lock(&rec_lock);
+		if (rec_fd >= 0)
+			rec_free(ptr);
+		pthread_mutex_unlock(&rec_lock);
+	}
+	mm_free(ptr);
+}
+
+/*
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   The C library's realloc, from mm_realloc.  While recording, the call
+ *   is made under the lock, as it may free "ptr" for another thread to
+ *   be handed before the call is recorded.
+ */
+void *
+realloc(void *ptr, size_t size)
+{
+	void *newptr;
+	size_t oldsize;
+
+	if (ptr == NULL)
+		return (shim_malloc(size));
+	if (IS_BOOT(ptr)) {
+		if ((newptr = shim_malloc(size)) != NULL) {
+			oldsize = malloc_usable_size(ptr);
+			memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+		}
+		return (newptr);
+	}
+
+	if (RECORDING()) {
+		pthread_mutex_lock(&rec_lock);
+		newptr = mm_realloc(ptr, size);
+		if (rec_fd >= 0)
+			rec_realloc(ptr, newptr, size);
+		pthread_mutex_unlock(&rec_lock);
+	} else
+		newptr = mm_realloc(ptr, size);
+	if (newptr == NULL && size != 0)
+		errno = ENOMEM;
+	return (newptr);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   The C library's calloc: a zeroed block for an array of "nmemb"
+ *   elements of "size" bytes, from mm_calloc, which clears only what is
+ *   not known to be zero.  Returns NULL if the product overflows.
+ */
+void *
+calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	void *p;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	if (total == 0)
+		nmemb = size = total = 1;
+	if (!shim_start()) {
+		if ((p = boot_alloc(total)) != NULL)
+			memset(p, 0, total);
+		return (p);
+	}
+	return (shim_done(mm_calloc(nmemb, size), total));
+}
+
+/*
+ * Requires:
+ *   "memptr" points to storage for the address of the block.
+ *
+ * Effects:
+ *   The POSIX aligned allocator.  Returns 0 and stores the address of the
+ *   block in "memptr", or returns EINVAL if "alignment" is not a power of
+ *   two multiple of the size of a pointer and ENOMEM if there is not
+ *   enough memory.
+ */
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+	    (alignment & (alignment - 1)) != 0)
+		return (EINVAL);
+	if ((p = shim_memalign(alignment, size)) == NULL)
+		return (ENOMEM);
+	*memptr = p;
+	return (0);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   The C11 aligned allocator.
+ */
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+
+	return (shim_memalign(alignment, size));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   The obsolete aligned allocator.
+ */
+void *
+memalign(size_t alignment, size_t size)
+{
+
+	return (shim_memalign(alignment, size));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocates a block that starts on a page.
+ */
+void *
+valloc(size_t size)
+{
+
+	return (shim_memalign(mem_pagesize(), size));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocates whole pages that start on a page.
+ */
+void *
+pvalloc(size_t size)
+{
+	size_t pagesize = mem_pagesize();
+
+	if (size > SIZE_MAX - pagesize) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	return (shim_memalign(pagesize,
+	    (size + pagesize - 1) & ~(pagesize - 1)));
+}
+
+/*
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Returns the number of bytes that the block "ptr" can hold.
+ */
+size_t
+malloc_usable_size(void *ptr)
+{
+
+	if (ptr != NULL && IS_BOOT(ptr))
+		return (*(size_t *)((char *)ptr - BOOT_ALIGN));
+	return (mm_usable_size(ptr));
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Starts the package if no thread has yet.  Returns true if it is ready
+ *   and false if the caller comes from inside the start, in which case it
+ *   should use the startup buffer.
+ */
+static bool
+shim_start(void)
+{
+
+	if (__atomic_load_n(&shim_ready, __ATOMIC_ACQUIRE))
+		return (true);
+	if (shim_starting)
+		return (false);
+	shim_starting = true;
+	pthread_once(&shim_once, shim_init);
+	shim_starting = false;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Starts memlib and the allocator, installs the fork handlers and starts
+ *   recording if MM_TRACE asks.  Aborts if the allocator cannot start.
+ */
+static void
+shim_init(void)
+{
+	static const char msg[] = "mmshim: mm_init failed\n";
+	const char *path;
+
+	mem_init();
+	if (mm_init() == -1) {
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		abort();
+	}
+	pthread_atfork(shim_prefork, shim_postfork_parent,
+	    shim_postfork_child);
+	if ((path = getenv("MM_TRACE")) != NULL && *path != '\0') {
+		if (!rec_start(path))
+			unsetenv("MM_TRACE");
+	}
+	__atomic_store_n(&shim_ready, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocates a block of at least "size" bytes, at least one, and records
+ *   it.  Returns its address, or NULL with errno set to ENOMEM.
+ */
+static void *
+shim_malloc(size_t size)
+{
+
+	if (size == 0)
+		size = 1;
+	if (!shim_start())
+		return (boot_alloc(size));
+	return (shim_done(mm_malloc(size), size));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   mm_memalign for the aligned allocators, with the conventions of
+ *   shim_malloc.  Sets errno to EINVAL if "alignment" is not a power of
+ *   two.
+ */
+static void *
+shim_memalign(size_t alignment, size_t size)
+{
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (size == 0)
+		size = 1;
+	if (!shim_start()) {
+		if (alignment <= BOOT_ALIGN)
+			return (boot_alloc(size));
+		errno = ENOMEM;
+		return (NULL);
+	}
+	return (shim_done(mm_memalign(alignment, size), size));
+}
+
+/*
+ * Requires:
+ *   "p" is the result of allocating "size" bytes.
+ *
+ * Effects:
+ *   Records the allocation if it succeeded, or sets errno if it failed.
+ *   Returns "p".
+ */
+static void *
+shim_done(void *p, size_t size)
+{
+
+	if (p == NULL)
+		errno = ENOMEM;
+	else if (RECORDING()) {
+		pthread_mutex_lock(&rec_lock);
+		if (rec_fd >= 0)
+			rec_alloc(p, size);
+		pthread_mutex_unlock(&rec_lock);
+	}
+	return (p);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Takes every lock before a fork, the recorder's first as it is held
+ *   around calls into the allocator.
+ */
+static void
+shim_prefork(void)
+{
+
+	pthread_mutex_lock(&rec_lock);
+	mm_prefork();
+}
+
+/*
+ * Requires:
+ *   The caller holds the locks taken by shim_prefork.
+ *
+ * Effects:
+ *   Releases them in the parent after a fork.
+ */
+static void
+shim_postfork_parent(void)
+{
+
+	mm_postfork();
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/*
+ * Requires:
+ *   The caller holds the locks taken by shim_prefork.
+ *
+ * Effects:
+ *   Releases them in the child after a fork, which stops recording: the
+ *   trace is its parent's.
+ */
+static void
+shim_postfork_child(void)
+{
+
+	mm_postfork();
+	if (rec_fd >= 0) {
+		close(rec_fd);
+		rec_fd = -1;
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocates "size" bytes from the startup buffer, after a word that
+ *   holds their number.  Returns their address, or NULL with errno set to
+ *   ENOMEM if the buffer is used up.
+ */
+static void *
+boot_alloc(size_t size)
+{
+	size_t n, off;
+
+	if (size > BOOT_SIZE) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	n = BOOT_ALIGN + ((size + BOOT_ALIGN - 1) & ~(size_t)(BOOT_ALIGN - 1));
+	off = __atomic_fetch_add(&boot_used, n, __ATOMIC_RELAXED);
+	if (off + n > BOOT_SIZE) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	*(size_t *)(boot_buf + off) = size;
+	return (boot_buf + off + BOOT_ALIGN);
+}
+
+/*
+ * The following routines record the trace.  All but rec_start and
+ * rec_exit require the caller to hold rec_lock while recording.
+ */
+
+/*
+ * Requires:
+ *   No other thread has started.
+ *
+ * Effects:
+ *   Creates the trace "path", in which each "%p" stands for the process
+ *   id, with a header for no requests, and starts recording to it.
+ *   Reports why if it cannot.  Returns true if "path" has a "%p".
+ */
+static bool
+rec_start(const char *path)
+{
+	static const char msg[] = "mmshim: cannot create MM_TRACE file\n";
+	trace_header_t hdr = { 0, 0, 0, 1 };
+	char name[PATH_MAX], digits[24];
+	unsigned long pid = (unsigned long)getpid();
+	bool per_pid = false;
+	size_t n = 0, k;
+	int fd;
+
+	for (; *path != '\0' && n < sizeof(name) - sizeof(digits); path++) {
+		if (path[0] != '%' || path[1] != 'p') {
+			name[n++] = *path;
+			continue;
+		}
+		k = sizeof(digits);
+		do
+			digits[--k] = (char)('0' + pid % 10);
+		while ((pid /= 10) > 0);
+		memcpy(name + n, digits + k, sizeof(digits) - k);
+		n += sizeof(digits) - k;
+		pid = (unsigned long)getpid();
+		per_pid = true;
+		path++;
+	}
+	name[n] = '\0';
+
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0644)) < 0) {
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		return (per_pid);
+	}
+	trace_put_header(rec_buf, &hdr);
+	rec_len = TRACE_HDRSIZE;
+	rec_fd = fd;
+	if (rec_flush() == -1)
+		rec_stop("cannot write MM_TRACE file");
+	return (per_pid);
+}
+
+/*
+ * Requires:
+ *   "p" is the address of a block of "size" bytes that was just
+ *   allocated.
+ *
+ * Effects:
+ *   Gives the block an id, a spare one if there is one, and records its
+ *   allocation.
+ */
+static void
+rec_alloc(void *p, size_t size)
+{
+	uint32_t id;
+
+	if (size > INT_MAX) {
+		rec_stop("block too large for a trace");
+		return;
+	}
+	if (rec_nspare > 0)
+		id = rec_spare[--rec_nspare];
+	else if (rec_nids <= TRACE_IDMAX)
+		id = rec_nids++;
+	else {
+		rec_stop("too many live blocks for a trace");
+		return;
+	}
+	if (rec_insert(p, id) == -1) {
+		rec_stop("out of memory");
+		return;
+	}
+	rec_put(TRACE_ALLOC, id, size);
+}
+
+/*
+ * Requires:
+ *   "p" is the address of a block that is about to be freed.
+ *
+ * Effects:
+ *   Records the free, if the block was allocated while recording, and
+ *   makes its id spare.
+ */
+static void
+rec_free(void *p)
+{
+	uint32_t *spare;
+	size_t bytes;
+	uint32_t id;
+
+	if (!rec_remove(p, &id))
+		return;
+	if (rec_nspare == rec_maxspare) {
+		bytes = (rec_maxspare ? 2 * rec_maxspare : REC_SLOTS) *
+		    sizeof(*spare);
+		spare = (rec_spare == NULL) ?
+		    mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+		    mremap(rec_spare, rec_maxspare * sizeof(*spare), bytes,
+			MREMAP_MAYMOVE);
+		if (spare == MAP_FAILED) {
+			rec_stop("out of memory");
+			return;
+		}
+		rec_spare = spare;
+		rec_maxspare = bytes / sizeof(*spare);
+	}
+	rec_spare[rec_nspare++] = id;
+	rec_put(TRACE_FREE, id, 0);
+}
+
+/*
+ * Requires:
+ *   "newp" is the result of reallocating "oldp", which is not NULL, to
+ *   "size" bytes.
+ *
+ * Effects:
+ *   Records the reallocation: as a free if it freed the block, as an
+ *   allocation if the old block was not recorded, and not at all if it
+ *   failed.
+ */
+static void
+rec_realloc(void *oldp, void *newp, size_t size)
+{
+	uint32_t id;
+
+	if (newp == NULL) {
+		if (size == 0)
+			rec_free(oldp);
+		return;
+	}
+	if (!rec_remove(oldp, &id)) {
+		rec_alloc(newp, size);
+		return;
+	}
+	if (size > INT_MAX) {
+		rec_stop("block too large for a trace");
+		return;
+	}
+	if (rec_insert(newp, id) == -1) {
+		rec_stop("out of memory");
+		return;
+	}
+	rec_put(TRACE_REALLOC, id, size);
+}
+
+/*
+ * Requires:
+ *   "size" is 0 for a free and at most INT_MAX.
+ *
+ * Effects:
+ *   Appends a request to the records, after a thread op if the calling
+ *   thread did not make the last one, writing them out first if they are
+ *   full.  Threads are numbered from 0 as they first make a request.
+ */
+static void
+rec_put(int type, uint32_t id, size_t size)
+{
+
+	if (rec_len + 2 * TRACE_OPMAX > REC_BUFSIZE && rec_flush() == -1) {
+		rec_stop("cannot write MM_TRACE file");
+		return;
+	}
+	if (rec_self == 0)
+		rec_self = ++rec_nthreads;
+	if (rec_self - 1 != rec_thread) {
+		rec_thread = rec_self - 1;
+		rec_len += trace_put_op(rec_buf + rec_len, TRACE_THREAD,
+		    rec_thread, 0);
+	}
+	rec_len += trace_put_op(rec_buf + rec_len, type, id, (uint32_t)size);
+	rec_nops++;
+}
+
+/*
+ * Requires:
+ *   The trace is open.
+ *
+ * Effects:
+ *   Writes out the records and then a header that counts them, so that
+ *   the trace is whole up to here.  Returns 0 on success and -1 otherwise.
+ */
+static int
+rec_flush(void)
+{
+	unsigned char buf[TRACE_HDRSIZE];
+	trace_header_t hdr;
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < rec_len; off += (size_t)n) {
+		if ((n = write(rec_fd, rec_buf + off, rec_len - off)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return (-1);
+		}
+	}
+	rec_len = 0;
+
+	hdr.sugg_heapsize = 0;
+	hdr.num_ids = rec_nids;
+	hdr.num_ops = rec_nops;
+	hdr.weight = 1;
+	trace_put_header(buf, &hdr);
+	if (pwrite(rec_fd, buf, TRACE_HDRSIZE, 0) != TRACE_HDRSIZE)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   The trace is open.
+ *
+ * Effects:
+ *   Flushes and closes the trace, so that nothing more is recorded.
+ *   Reports "why", unless it is NULL.
+ */
+static void
+rec_stop(const char *why)
+{
+	static const char prefix[] = "mmshim: recording stopped: ";
+
+	if (why != NULL) {
+		write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+		write(STDERR_FILENO, why, strlen(why));
+		write(STDERR_FILENO, "\n", 1);
+	}
+	rec_flush();
+	close(rec_fd);
+	__atomic_store_n(&rec_fd, -1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Requires:
+ *   "p" is not in the address table.
+ *
+ * Effects:
+ *   Maps "p" to "id" in the address table, doubling the table if it is
+ *   half full.  Returns 0 on success and -1 if there is no memory.
+ */
+static int
+rec_insert(void *p, uint32_t id)
+{
+	struct rec_slot *table;
+	size_t i, j, nslots;
+
+	if (2 * (rec_nlive + 1) > rec_nslots) {
+		nslots = rec_nslots ? 2 * rec_nslots : REC_SLOTS;
+		table = mmap(NULL, nslots * sizeof(*table),
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (table == MAP_FAILED)
+			return (-1);
+		for (i = 0; i < rec_nslots; i++) {
+			if (rec_table[i].ptr == NULL)
+				continue;
+			for (j = rec_home(rec_table[i].ptr, nslots);
+			    table[j].ptr != NULL; j = (j + 1) & (nslots - 1))
+				continue;
+			table[j] = rec_table[i];
+		}
+		if (rec_table != NULL)
+			munmap(rec_table, rec_nslots * sizeof(*table));
+		rec_table = table;
+		rec_nslots = nslots;
+	}
+	for (i = rec_home(p, rec_nslots); rec_table[i].ptr != NULL;
+	    i = (i + 1) & (rec_nslots - 1))
+		continue;
+	rec_table[i].ptr = p;
+	rec_table[i].id = id;
+	rec_nlive++;
+	return (0);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Removes "p" from the address table and stores its id in "id".
+ *   Returns false if "p" was not there.  The slots after it that would
+ *   no longer be reached move back, so the table needs no tombstones.
+ */
+static bool
+rec_remove(void *p, uint32_t *id)
+{
+	size_t mask = rec_nslots - 1;
+	size_t i, j, home;
+
+	if (rec_table == NULL)
+		return (false);
+	for (i = rec_home(p, rec_nslots); rec_table[i].ptr != p;
+	    i = (i + 1) & mask) {
+		if (rec_table[i].ptr == NULL)
+			return (false);
+	}
+	*id = rec_table[i].id;
+	for (j = (i + 1) & mask; rec_table[j].ptr != NULL; j = (j + 1) & mask) {
+		home = rec_home(rec_table[j].ptr, rec_nslots);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rec_table[i] = rec_table[j];
+			i = j;
+		}
+	}
+	rec_table[i].ptr = NULL;
+	rec_nlive--;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "nslots" is a power of two.
+ *
+ * Effects:
+ *   Returns the slot of a table of "nslots" slots where the search for
+ *   "p" starts.
+ */
+static size_t
+rec_home(void *p, size_t nslots)
+{
+
+	return ((size_t)(((uintptr_t)p * (uintptr_t)0x9e3779b97f4a7c15ULL) >>
+	    16) & (nslots - 1));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Finishes the trace when the process exits.  Calls made after this
+ *   are not recorded.
+ */
+static void
+rec_exit(void)
+{
+
+	pthread_mutex_lock(&rec_lock);
+	if (rec_fd >= 0)
+		rec_stop(NULL);
+	pthread_mutex_unlock(&rec_lock);
+}
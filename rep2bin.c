@@ -0,0 +1,133 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) to the binary trace format
+ *
+ * usage: rep2bin <in.rep> <out.bin>
+ *
+ * The text trace is read a line at a time, so a trace of any length
+ * converts in constant memory.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static void convert_error(const char *path, unsigned long line,
+			  const char *msg) __attribute__((noreturn));
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t hdr;
+    unsigned char buf[TRACE_HDRSIZE > TRACE_OPMAX ? TRACE_HDRSIZE :
+		      TRACE_OPMAX];
+    char line[MAXLINE];
+    char *p, *end;
+    unsigned long id, size, lineno = 0;
+    unsigned long long num_ops, ops = 0;
+    unsigned long fields[4];
+    int i, type;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+
+    /* The header is four numbers, one per line */
+    for (i = 0; i < 4; i++) {
+	lineno++;
+	if (fgets(line, sizeof(line), in) == NULL)
+	    convert_error(argv[1], lineno, "truncated header");
+	errno = 0;
+	fields[i] = strtoul(line, &end, 10);
+	if (end == line || errno != 0)
+	    convert_error(argv[1], lineno, "bad header field");
+    }
+    hdr.sugg_heapsize = (uint32_t)fields[0];
+    hdr.num_ids = (uint32_t)fields[1];
+    hdr.num_ops = num_ops = fields[2];
+    hdr.weight = (uint32_t)fields[3];
+    if (fields[1] > (unsigned long)TRACE_IDMAX + 1)
+	convert_error(argv[1], 2, "too many ids");
+
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    trace_put_header(buf, &hdr);
+    fwrite(buf, 1, TRACE_HDRSIZE, out);
+
+    /*
+     * Then one request per line: "a id size", "r id size" or "f id",
+     * and the thread ops, "t thread", that are not counted as requests
+     */
+    while (fgets(line, sizeof(line), in) != NULL) {
+	lineno++;
+	for (p = line; *p == ' ' || *p == '\t'; p++)
+	    ;
+	if (*p == '\n' || *p == '\0')
+	    continue;
+	switch (*p) {
+	case 'a':
+	    type = TRACE_ALLOC;
+	    break;
+	case 'r':
+	    type = TRACE_REALLOC;
+	    break;
+	case 'f':
+	    type = TRACE_FREE;
+	    break;
+	case 't':
+	    type = TRACE_THREAD;
+	    break;
+	default:
+	    convert_error(argv[1], lineno, "bogus type character");
+	}
+	id = strtoul(p + 1, &end, 10);
+	if (type == TRACE_THREAD) {
+	    if (end == p + 1 || id > TRACE_IDMAX)
+		convert_error(argv[1], lineno, "bad thread");
+	    fwrite(buf, 1, trace_put_op(buf, type, (uint32_t)id, 0), out);
+	    continue;
+	}
+	if (end == p + 1 || id >= hdr.num_ids)
+	    convert_error(argv[1], lineno, "bad block id");
+	size = 0;
+	if (type != TRACE_FREE) {
+	    p = end;
+	    errno = 0;
+	    size = strtoul(p, &end, 10);
+	    if (end == p || errno != 0 || size > UINT32_MAX)
+		convert_error(argv[1], lineno, "bad size");
+	}
+	fwrite(buf, 1, trace_put_op(buf, type, (uint32_t)id,
+				    (uint32_t)size), out);
+	ops++;
+    }
+    if (ops != num_ops)
+	convert_error(argv[1], lineno, "op count does not match header");
+
+    fclose(in);
+    if (ferror(out) || fclose(out) != 0) {
+	fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    return 0;
+}
+
+/*
+ * convert_error - Report a malformed line of the text trace and exit
+ */
+static void convert_error(const char *path, unsigned long line,
+			  const char *msg)
+{
+    fprintf(stderr, "%s:%lu: %s\n", path, line, msg);
+    exit(1);
+}
@@ -0,0 +1,111 @@
+/*
+ * shimcheck.c - Check the LD_PRELOAD malloc shim with the profiler on
+ *
+ * usage: LD_PRELOAD=./libmm.so shimcheck [profile]
+ *
+ * Samples every allocation, keeps a few megabytes live while other
+ * threads allocate and free, and writes a heap profile.  Under the shim
+ * the C library's own allocations while the profile is written are
+ * sampled too, so this catches the profiler calling back into itself.
+ * An alarm fails the check if the dump hangs.
+ */
+#define _GNU_SOURCE /* for RTLD_DEFAULT */
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+
+#define NTHREADS 4        /* threads allocating during the dump */
+#define NLIVE    4096     /* blocks kept live by the main thread */
+#define TIMEOUT  10       /* seconds before the check is failed */
+#define MAXLINE  1024     /* max string size */
+
+static int stop;
+
+static void check_error(const char *msg) __attribute__((noreturn));
+static void *churn(void *arg);
+
+int main(int argc, char **argv)
+{
+    int (*setopt)(int, size_t);
+    int (*prof_dump)(const char *);
+    const char *path = argc > 1 ? argv[1] : "shimcheck.prof";
+    pthread_t tids[NTHREADS];
+    static void *live[NLIVE];
+    char line[MAXLINE];
+    unsigned long nbuckets = 0;
+    FILE *fp;
+    int i;
+
+    setopt = (int (*)(int, size_t))dlsym(RTLD_DEFAULT, "mm_setopt");
+    prof_dump = (int (*)(const char *))dlsym(RTLD_DEFAULT, "mm_prof_dump");
+    if (setopt == NULL || prof_dump == NULL)
+	check_error("mm_setopt not found: run with LD_PRELOAD=./libmm.so");
+    alarm(TIMEOUT);
+
+    if (setopt(MM_OPT_PROF_RATE, 1) != 0)
+	check_error("mm_setopt(MM_OPT_PROF_RATE) failed");
+    for (i = 0; i < NLIVE; i++) {
+	if ((live[i] = malloc(1 + (size_t)i % 2048)) == NULL)
+	    check_error("malloc failed");
+    }
+    for (i = 0; i < NTHREADS; i++) {
+	if (pthread_create(&tids[i], NULL, churn, NULL) != 0)
+	    check_error("pthread_create failed");
+    }
+
+    if (prof_dump(path) != 0)
+	check_error("mm_prof_dump failed");
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < NTHREADS; i++)
+	pthread_join(tids[i], NULL);
+    for (i = 0; i < NLIVE; i++)
+	free(live[i]);
+
+    /* A header, then a line per call stack before the memory map */
+    if ((fp = fopen(path, "r")) == NULL)
+	check_error("cannot reopen the profile");
+    if (fgets(line, sizeof(line), fp) == NULL ||
+	strncmp(line, "heap profile: ", 14) != 0)
+	check_error("profile has no header");
+    while (fgets(line, sizeof(line), fp) != NULL && line[0] != '\n')
+	nbuckets++;
+    fclose(fp);
+    if (nbuckets == 0)
+	check_error("profile has no samples");
+
+    printf("ok: %lu call stacks in %s\n", nbuckets, path);
+    exit(0);
+}
+
+/*
+ * check_error - Report a failed check and exit
+ */
+static void check_error(const char *msg)
+{
+    fprintf(stderr, "shimcheck: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * churn - Allocate and free blocks until the main thread says stop
+ */
+static void *churn(void *arg)
+{
+    void *p;
+    size_t size = 1;
+
+    (void)arg;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+	if ((p = malloc(size)) == NULL)
+	    check_error("malloc failed");
+	free(p);
+	size = size % 70000 + 17;
+    }
+    return NULL;
+}
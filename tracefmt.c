@@ -0,0 +1,111 @@
+/*
+ * tracefmt.c - Encode and decode the binary trace format of tracefmt.h
+ */
+#include <string.h>
+
+#include "tracefmt.h"
+
+/* Read and write little-endian words */
+static void put32(unsigned char *p, uint32_t x);
+static uint32_t get32(const unsigned char *p);
+
+/*
+ * trace_put_header - Encode the header hdr into the TRACE_HDRSIZE
+ *     bytes at p
+ */
+void trace_put_header(unsigned char *p, const trace_header_t *hdr)
+{
+    memset(p, 0, TRACE_HDRSIZE);
+    memcpy(p, TRACE_MAGIC, 8);
+    put32(p + 8, hdr->sugg_heapsize);
+    put32(p + 12, hdr->num_ids);
+    put32(p + 16, (uint32_t)hdr->num_ops);
+    put32(p + 20, (uint32_t)(hdr->num_ops >> 32));
+    put32(p + 24, hdr->weight);
+}
+
+/*
+ * trace_get_header - Decode the TRACE_HDRSIZE bytes at p into hdr.
+ *     Returns 0, or -1 if they are not the header of a binary trace.
+ */
+int trace_get_header(const unsigned char *p, trace_header_t *hdr)
+{
+    if (memcmp(p, TRACE_MAGIC, 8) != 0)
+	return -1;
+    hdr->sugg_heapsize = get32(p + 8);
+    hdr->num_ids = get32(p + 12);
+    hdr->num_ops = get32(p + 16) | (uint64_t)get32(p + 20) << 32;
+    hdr->weight = get32(p + 24);
+    return 0;
+}
+
+/*
+ * trace_put_op - Encode a request of the given type for block id into
+ *     the TRACE_OPMAX bytes at p, with its size unless it is a free, or
+ *     a thread op for thread id. Returns the number of bytes used.
+ */
+size_t trace_put_op(unsigned char *p, int type, uint32_t id, uint32_t size)
+{
+    size_t n = 4;
+
+    put32(p, (uint32_t)type << 30 | id);
+    if (type == TRACE_FREE || type == TRACE_THREAD)
+	return n;
+    while (size >= 0x80) {
+	p[n++] = (unsigned char)(size | 0x80);
+	size >>= 7;
+    }
+    p[n++] = (unsigned char)size;
+    return n;
+}
+
+/*
+ * trace_get_op - Decode the op at p, which lies before end, into type,
+ *     id and size (0 for a free or a thread op). Returns the address of
+ *     the next op, or NULL if the op is malformed or runs past end.
+ */
+const unsigned char *trace_get_op(const unsigned char *p,
+				  const unsigned char *end, int *type,
+				  uint32_t *id, uint32_t *size)
+{
+    uint32_t word;
+    int shift;
+
+    if (end - p < 4)
+	return NULL;
+    word = get32(p);
+    p += 4;
+    *type = (int)(word >> 30);
+    *id = word & TRACE_IDMAX;
+    *size = 0;
+    if (*type == TRACE_FREE || *type == TRACE_THREAD)
+	return p;
+    for (shift = 0; shift < 32; shift += 7) {
+	if (p == end)
+	    return NULL;
+	*size |= (uint32_t)(*p & 0x7f) << shift;
+	if ((*p++ & 0x80) == 0)
+	    return p;
+    }
+    return NULL;
+}
+
+/*
+ * put32 - Store x at p in little-endian order
+ */
+static void put32(unsigned char *p, uint32_t x)
+{
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    p[2] = (unsigned char)(x >> 16);
+    p[3] = (unsigned char)(x >> 24);
+}
+
+/*
+ * get32 - Load a little-endian word from p
+ */
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	(uint32_t)p[3] << 24;
+}
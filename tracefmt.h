@@ -0,0 +1,43 @@
+/*
+ * tracefmt.h - The binary trace format
+ *
+ * A binary trace starts with a TRACE_HDRSIZE-byte header that holds
+ * TRACE_MAGIC and the four numbers of a text trace's header. The ops
+ * follow back to back. Each op is a 32-bit word whose top two bits
+ * are the request type and whose low 30 bits are the block id; the
+ * word of an alloc or realloc request is followed by the request's
+ * size as an unsigned LEB128 varint. All words are little-endian.
+ *
+ * A thread op, which has no size and is not counted as a request, says
+ * that the requests after it, up to the next thread op, were made by the
+ * thread whose number is in the low 30 bits. Requests before the first
+ * one were made by thread 0. A text trace spells it "t <thread>".
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC    "mmtrace1"  /* first 8 bytes of a binary trace */
+#define TRACE_HDRSIZE  32          /* bytes in the header */
+#define TRACE_OPMAX    9           /* most bytes in one op */
+#define TRACE_IDMAX    ((1u << 30) - 1) /* largest block id */
+
+/* Request types, in the top two bits of an op */
+#define TRACE_ALLOC    0
+#define TRACE_FREE     1
+#define TRACE_REALLOC  2
+#define TRACE_THREAD   3
+
+/* The header of a trace, text or binary */
+typedef struct {
+    uint32_t sugg_heapsize;   /* suggested heap size (unused) */
+    uint32_t num_ids;         /* number of alloc/realloc ids */
+    uint64_t num_ops;         /* number of distinct requests */
+    uint32_t weight;          /* weight for this trace (unused) */
+} trace_header_t;
+
+void trace_put_header(unsigned char *p, const trace_header_t *hdr);
+int trace_get_header(const unsigned char *p, trace_header_t *hdr);
+size_t trace_put_op(unsigned char *p, int type, uint32_t id, uint32_t size);
+const unsigned char *trace_get_op(const unsigned char *p,
+				  const unsigned char *end, int *type,
+				  uint32_t *id, uint32_t *size);